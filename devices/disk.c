@@ -7,6 +7,9 @@
 #include "threads/io.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -32,6 +35,7 @@
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -47,6 +51,50 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors a single READ/WRITE command can transfer. */
+#define MAX_SECTORS_PER_CMD 256
+
+/* Most requests merged into a single command.  Each sector may take
+   two PRD entries, so a merged command always fits a one-page PRD
+   table. */
+#define MAX_MERGE 64
+
+/* PCI configuration space ports. */
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+/* PIIX bus master IDE registers, relative to a channel's bm_base. */
+#define BM_COMMAND 0            /* Command. */
+#define BM_STATUS 2             /* Status. */
+#define BM_PRDT 4               /* Physical address of the PRD table. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from the disk to memory. */
+
+/* Bus master Status Register bits. */
+#define BM_STA_ERR 0x02         /* Error. */
+#define BM_STA_INTR 0x04        /* Interrupt raised. */
+
+/* A physical region descriptor: one entry of a PRD table, describing
+   a memory region that must not cross a 64 kB boundary. */
+struct prd {
+	uint32_t addr;              /* Physical address. */
+	uint16_t size;              /* Byte count, 0 meaning 64 kB. */
+	uint16_t flags;             /* PRD_EOT on the last entry. */
+};
+#define PRD_EOT 0x8000
+
+/* If true, use bus master DMA when the controller supports it.
+   Controlled by kernel command-line option "-dma". */
+bool disk_dma;
 
 /* An ATA device. */
 struct disk {
@@ -56,6 +104,10 @@ struct disk {
 
 	bool is_ata;                /* 1=This device is an ATA disk. */
 	disk_sector_t capacity;     /* Capacity in sectors (if is_ata). */
+	int multiple;               /* Sectors per interrupt with READ/WRITE
+								   MULTIPLE, or 0 if unsupported. */
+	bool dma;                   /* Supports DMA transfers? */
+	disk_sector_t head;         /* Sector after the last transfer. */
 
 	long long read_cnt;         /* Number of sectors read. */
 	long long write_cnt;        /* Number of sectors written. */
@@ -68,11 +120,19 @@ struct channel {
 	uint16_t reg_base;          /* Base I/O port. */
 	uint8_t irq;                /* Interrupt in use. */
 
-	struct lock lock;           /* Must acquire to access the controller. */
+	struct lock lock;           /* Protects the request queue. */
+	struct list queue;          /* Pending requests, in submission order. */
+	struct condition queue_cond;        /* Signaled when a request arrives. */
+
+	/* Only the channel's dispatcher thread accesses the controller
+	   once disk_init() returns. */
 	bool expecting_interrupt;   /* True if an interrupt is expected, false if
 								   any interrupt would be spurious. */
 	struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+	uint16_t bm_base;           /* Bus master registers, 0 if DMA is off. */
+	struct prd *prdt;           /* PRD table, one page. */
+
 	struct disk devices[2];     /* The devices on this channel. */
 };
 
@@ -84,11 +144,32 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct disk *);
 static void identify_ata_device (struct disk *);
 
-static void select_sector (struct disk *, disk_sector_t);
+static void select_sector (struct disk *, disk_sector_t, size_t cnt);
+static void set_multiple_mode (struct disk *, uint16_t max);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
 
+/* Position within the buffers of a batch of requests that are
+   transferred by one command. */
+struct disk_cursor {
+	struct list_elem *e;        /* Current request. */
+	size_t sector;              /* Next sector within it. */
+};
+static uint8_t *cursor_next (struct disk_cursor *);
+
+static uint16_t find_bus_master (void);
+static bool use_dma (const struct disk *);
+static void dma_transfer (struct disk *, disk_sector_t,
+		struct disk_cursor *, size_t cnt, bool write);
+
+static void pio_read (struct disk *, disk_sector_t, struct disk_cursor *,
+		size_t cnt);
+static void pio_write (struct disk *, disk_sector_t, struct disk_cursor *,
+		size_t cnt);
+
+static thread_func disk_dispatcher NO_RETURN;
+
 static void wait_until_idle (const struct disk *);
 static bool wait_while_busy (const struct disk *);
 static void select_device (const struct disk *);
@@ -100,6 +181,10 @@ static void interrupt_handler (struct intr_frame *);
 void
 disk_init (void) {
 	size_t chan_no;
+	uint16_t bm_base = disk_dma ? find_bus_master () : 0;
+
+	if (disk_dma && bm_base == 0)
+		printf ("disk: no bus master IDE controller, using PIO\n");
 
 	for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++) {
 		struct channel *c = &channels[chan_no];
@@ -120,8 +205,17 @@ disk_init (void) {
 				NOT_REACHED ();
 		}
 		lock_init (&c->lock);
+		list_init (&c->queue);
+		cond_init (&c->queue_cond);
 		c->expecting_interrupt = false;
 		sema_init (&c->completion_wait, 0);
+		c->bm_base = 0;
+		c->prdt = NULL;
+		if (bm_base != 0) {
+			c->prdt = palloc_get_page (0);
+			if (c->prdt != NULL)
+				c->bm_base = bm_base + 8 * chan_no;
+		}
 
 		/* Initialize devices. */
 		for (dev_no = 0; dev_no < 2; dev_no++) {
@@ -132,6 +226,9 @@ disk_init (void) {
 
 			d->is_ata = false;
 			d->capacity = 0;
+			d->multiple = 0;
+			d->dma = false;
+			d->head = 0;
 
 			d->read_cnt = d->write_cnt = 0;
 		}
@@ -150,6 +247,10 @@ disk_init (void) {
 		for (dev_no = 0; dev_no < 2; dev_no++)
 			if (c->devices[dev_no].is_ata)
 				identify_ata_device (&c->devices[dev_no]);
+
+		/* From now on requests go through the dispatcher. */
+		if (thread_create (c->name, PRI_MAX, disk_dispatcher, c) == TID_ERROR)
+			PANIC ("%s: cannot start dispatcher", c->name);
 	}
 
 	/* DO NOT MODIFY BELOW LINES. */
@@ -209,21 +310,7 @@ disk_size (struct disk *d) {
    per-disk locking is unneeded. */
 void
 disk_read (struct disk *d, disk_sector_t sec_no, void *buffer) {
-	struct channel *c;
-
-	ASSERT (d != NULL);
-	ASSERT (buffer != NULL);
-
-	c = d->channel;
-	lock_acquire (&c->lock);
-	select_sector (d, sec_no);
-	issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-	sema_down (&c->completion_wait);
-	if (!wait_while_busy (d))
-		PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-	input_sector (c, buffer);
-	d->read_cnt++;
-	lock_release (&c->lock);
+	disk_read_multi (d, sec_no, buffer, 1);
 }
 
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
@@ -233,23 +320,238 @@ disk_read (struct disk *d, disk_sector_t sec_no, void *buffer) {
    per-disk locking is unneeded. */
 void
 disk_write (struct disk *d, disk_sector_t sec_no, const void *buffer) {
-	struct channel *c;
+	disk_write_multi (d, sec_no, buffer, 1);
+}
 
+/* Reads CNT consecutive sectors starting at SEC_NO from disk D
+   into BUFFER, which must have room for CNT * DISK_SECTOR_SIZE
+   bytes.  Up to MAX_SECTORS_PER_CMD sectors are transferred by a
+   single command, by DMA if enabled and otherwise by PIO.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+void
+disk_read_multi (struct disk *d, disk_sector_t sec_no, void *buffer,
+		size_t cnt) {
+	struct disk_request r;
+
+	disk_request_init (&r, d, sec_no, buffer, cnt, false);
+	disk_submit (&r);
+	disk_wait (&r);
+}
+
+/* Writes CNT consecutive sectors starting at SEC_NO to disk D from
+   BUFFER, which must contain CNT * DISK_SECTOR_SIZE bytes.  Returns
+   after the disk has acknowledged receiving the data.  Batches the
+   transfer as disk_read_multi() does.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+void
+disk_write_multi (struct disk *d, disk_sector_t sec_no, const void *buffer,
+		size_t cnt) {
+	struct disk_request r;
+
+	disk_request_init (&r, d, sec_no, (void *) buffer, cnt, true);
+	disk_submit (&r);
+	disk_wait (&r);
+}
+
+/* Asynchronous requests. */
+
+/* Initializes R to transfer CNT sectors starting at SEC_NO between
+   disk D and BUFFER, writing to the disk if WRITE and reading from
+   it otherwise.  The submitter waits for R with disk_wait().
+   BUFFER must be kernel memory: the transfer is carried out by the
+   channel's dispatcher thread, which runs on the kernel page table
+   and cannot reach the submitter's user pages. */
+void
+disk_request_init (struct disk_request *r, struct disk *d,
+		disk_sector_t sec_no, void *buffer, size_t cnt, bool write) {
 	ASSERT (d != NULL);
 	ASSERT (buffer != NULL);
+	ASSERT (is_kernel_vaddr (buffer));
+	ASSERT (cnt > 0);
+	ASSERT (sec_no + cnt <= d->capacity);
+
+	r->disk = d;
+	r->sec_no = sec_no;
+	r->cnt = cnt;
+	r->buffer = buffer;
+	r->write = write;
+	sema_init (&r->done, 0);
+}
+
+/* Queues R on its disk's channel and returns immediately.  R and
+   its buffer must stay valid until the request completes. */
+void
+disk_submit (struct disk_request *r) {
+	struct channel *c = r->disk->channel;
 
-	c = d->channel;
 	lock_acquire (&c->lock);
-	select_sector (d, sec_no);
-	issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-	if (!wait_while_busy (d))
-		PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-	output_sector (c, buffer);
-	sema_down (&c->completion_wait);
-	d->write_cnt++;
+	list_push_back (&c->queue, &r->elem);
+	cond_signal (&c->queue_cond, &c->lock);
 	lock_release (&c->lock);
 }
-
+
+/* Waits until R has been carried out. */
+void
+disk_wait (struct disk_request *r) {
+	sema_down (&r->done);
+}
+
+/* Returns true if requests A and B touch a common sector of the
+   same disk and at least one of them writes it. */
+static bool
+requests_conflict (const struct disk_request *a,
+		const struct disk_request *b) {
+	return a->disk == b->disk && (a->write || b->write)
+		&& a->sec_no < b->sec_no + b->cnt && b->sec_no < a->sec_no + a->cnt;
+}
+
+/* Returns true if queued request R may be carried out now, that is,
+   if it does not conflict with a request submitted before it.  This
+   keeps overlapping reads and writes in submission order. */
+static bool
+request_ready (struct channel *c, struct disk_request *r) {
+	struct list_elem *e;
+
+	for (e = list_begin (&c->queue); e != &r->elem; e = list_next (e))
+		if (requests_conflict (list_entry (e, struct disk_request, elem), r))
+			return false;
+	return true;
+}
+
+/* Removes and returns the next request of channel C to carry out,
+   following C-LOOK: the ready request with the lowest sector at or
+   above its disk's head, or the lowest sector overall once the head
+   has passed every request. */
+static struct disk_request *
+pick_request (struct channel *c) {
+	struct disk_request *best = NULL;
+	bool best_ahead = false;
+	struct list_elem *e;
+
+	ASSERT (lock_held_by_current_thread (&c->lock));
+
+	for (e = list_begin (&c->queue); e != list_end (&c->queue);
+			e = list_next (e)) {
+		struct disk_request *r = list_entry (e, struct disk_request, elem);
+		bool ahead = r->sec_no >= r->disk->head;
+
+		if (!request_ready (c, r))
+			continue;
+		if (best == NULL || (ahead && !best_ahead)
+				|| (ahead == best_ahead && r->sec_no < best->sec_no)) {
+			best = r;
+			best_ahead = ahead;
+		}
+	}
+
+	/* The oldest request is always ready. */
+	ASSERT (best != NULL);
+	list_remove (&best->elem);
+	return best;
+}
+
+/* Appends to BATCH, which holds one request, the queued requests of
+   channel C that continue it on the disk in the same direction, so
+   that they are carried out by the same command.  Returns the total
+   number of sectors in BATCH. */
+static size_t
+merge_requests (struct channel *c, struct list *batch) {
+	struct disk_request *first =
+		list_entry (list_front (batch), struct disk_request, elem);
+	size_t total = first->cnt;
+	size_t merged = 1;
+
+	ASSERT (lock_held_by_current_thread (&c->lock));
+
+	while (merged < MAX_MERGE) {
+		struct disk_request *next = NULL;
+		struct list_elem *e;
+
+		for (e = list_begin (&c->queue); e != list_end (&c->queue);
+				e = list_next (e)) {
+			struct disk_request *r = list_entry (e, struct disk_request, elem);
+			if (r->disk == first->disk && r->write == first->write
+					&& r->sec_no == first->sec_no + total
+					&& total + r->cnt <= MAX_SECTORS_PER_CMD
+					&& request_ready (c, r)) {
+				next = r;
+				break;
+			}
+		}
+		if (next == NULL)
+			break;
+
+		list_remove (&next->elem);
+		list_push_back (batch, &next->elem);
+		total += next->cnt;
+		merged++;
+	}
+	return total;
+}
+
+/* Carries out the requests in BATCH, which are contiguous on the
+   disk and go in the same direction, using as few commands as
+   possible. */
+static void
+transfer_batch (struct list *batch, size_t total) {
+	struct disk_request *first =
+		list_entry (list_front (batch), struct disk_request, elem);
+	struct disk *d = first->disk;
+	struct disk_cursor cur = { list_front (batch), 0 };
+	disk_sector_t sec_no = first->sec_no;
+
+	while (total > 0) {
+		size_t cnt = total < MAX_SECTORS_PER_CMD ? total : MAX_SECTORS_PER_CMD;
+
+		if (use_dma (d))
+			dma_transfer (d, sec_no, &cur, cnt, first->write);
+		else if (first->write)
+			pio_write (d, sec_no, &cur, cnt);
+		else
+			pio_read (d, sec_no, &cur, cnt);
+
+		if (first->write)
+			d->write_cnt += cnt;
+		else
+			d->read_cnt += cnt;
+		sec_no += cnt;
+		total -= cnt;
+	}
+	d->head = sec_no;
+}
+
+/* Dispatcher thread of channel C_, the only thread that drives the
+   controller.  It carries out queued requests in C-LOOK order,
+   merging adjacent ones, and sleeps on the completion interrupt
+   while each command is in progress. */
+static void
+disk_dispatcher (void *c_) {
+	struct channel *c = c_;
+
+	for (;;) {
+		struct list batch;
+		size_t total;
+
+		lock_acquire (&c->lock);
+		while (list_empty (&c->queue))
+			cond_wait (&c->queue_cond, &c->lock);
+		list_init (&batch);
+		list_push_back (&batch, &pick_request (c)->elem);
+		total = merge_requests (c, &batch);
+		lock_release (&c->lock);
+
+		transfer_batch (&batch, total);
+
+		while (!list_empty (&batch)) {
+			struct disk_request *r =
+				list_entry (list_pop_front (&batch), struct disk_request, elem);
+			sema_up (&r->done);
+		}
+	}
+}
+
 /* Disk detection and identification. */
 
 static void print_ata_string (char *string, size_t size);
@@ -364,6 +666,10 @@ identify_ata_device (struct disk *d) {
 	/* Calculate capacity. */
 	d->capacity = id[60] | ((uint32_t) id[61] << 16);
 
+	/* Transfer several sectors per interrupt, if supported. */
+	set_multiple_mode (d, id[47] & 0xff);
+	d->dma = (id[49] & 0x0100) != 0;
+
 	/* Print identification message. */
 	printf ("%s: detected %'"PRDSNu" sector (", d->name, d->capacity);
 	if (d->capacity > 1024 / DISK_SECTOR_SIZE * 1024 * 1024)
@@ -382,6 +688,29 @@ identify_ata_device (struct disk *d) {
 	printf ("\"\n");
 }
 
+/* Enables READ/WRITE MULTIPLE on disk D with the largest power of
+   two that does not exceed MAX sectors per interrupt, the limit
+   reported by IDENTIFY DEVICE.  Leaves D->multiple at 0 if the
+   disk does not support it. */
+static void
+set_multiple_mode (struct disk *d, uint16_t max) {
+	struct channel *c = d->channel;
+	uint16_t cnt = 1;
+
+	if (max < 2)
+		return;
+	while (cnt * 2 <= max)
+		cnt *= 2;
+
+	select_device_wait (d);
+	outb (reg_nsect (c), cnt);
+	issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+	sema_down (&c->completion_wait);
+	wait_while_busy (d);
+	if (!(inb (reg_alt_status (c)) & STA_ERR))
+		d->multiple = cnt;
+}
+
 /* Prints STRING, which consists of SIZE bytes in a funky format:
    each pair of bytes is in reverse order.  Does not print
    trailing whitespace and/or nulls. */
@@ -402,17 +731,18 @@ print_ata_string (char *string, size_t size) {
 }
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the count of CNT sectors to the disk's sector
+   selection registers.  (We use LBA mode.) */
 static void
-select_sector (struct disk *d, disk_sector_t sec_no) {
+select_sector (struct disk *d, disk_sector_t sec_no, size_t cnt) {
 	struct channel *c = d->channel;
 
-	ASSERT (sec_no < d->capacity);
-	ASSERT (sec_no < (1UL << 28));
+	ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_CMD);
+	ASSERT (sec_no + cnt <= d->capacity);
+	ASSERT (sec_no + cnt <= (1UL << 28));
 
 	select_device_wait (d);
-	outb (reg_nsect (c), 1);
+	outb (reg_nsect (c), cnt == MAX_SECTORS_PER_CMD ? 0 : cnt);
 	outb (reg_lbal (c), sec_no);
 	outb (reg_lbam (c), sec_no >> 8);
 	outb (reg_lbah (c), (sec_no >> 16));
@@ -446,6 +776,179 @@ output_sector (struct channel *c, const void *sector) {
 	outsw (reg_data (c), sector, DISK_SECTOR_SIZE / 2);
 }
 
+/* Returns the buffer for the next sector at CUR and advances it. */
+static uint8_t *
+cursor_next (struct disk_cursor *cur) {
+	struct disk_request *r = list_entry (cur->e, struct disk_request, elem);
+	uint8_t *p = (uint8_t *) r->buffer + cur->sector * DISK_SECTOR_SIZE;
+
+	if (++cur->sector == r->cnt) {
+		cur->e = list_next (cur->e);
+		cur->sector = 0;
+	}
+	return p;
+}
+
+/* Reads CNT sectors starting at SEC_NO from disk D into the buffers
+   at CUR with a single PIO command, taking one interrupt per block
+   of D->multiple sectors (or per sector, if D does not support READ
+   MULTIPLE). */
+static void
+pio_read (struct disk *d, disk_sector_t sec_no, struct disk_cursor *cur,
+		size_t cnt) {
+	struct channel *c = d->channel;
+	size_t block = d->multiple > 0 ? (size_t) d->multiple : 1;
+
+	select_sector (d, sec_no, cnt);
+	issue_pio_command (c, d->multiple > 0
+			? CMD_READ_MULTIPLE : CMD_READ_SECTOR_RETRY);
+	for (size_t done = 0; done < cnt; done += block) {
+		size_t n = cnt - done < block ? cnt - done : block;
+
+		sema_down (&c->completion_wait);
+		if (!wait_while_busy (d))
+			PANIC ("%s: disk read failed, sector=%"PRDSNu,
+					d->name, sec_no + (disk_sector_t) done);
+		while (n-- > 0)
+			input_sector (c, cursor_next (cur));
+	}
+}
+
+/* Writes CNT sectors starting at SEC_NO to disk D from the buffers
+   at CUR with a single PIO command, as pio_read() does. */
+static void
+pio_write (struct disk *d, disk_sector_t sec_no, struct disk_cursor *cur,
+		size_t cnt) {
+	struct channel *c = d->channel;
+	size_t block = d->multiple > 0 ? (size_t) d->multiple : 1;
+
+	select_sector (d, sec_no, cnt);
+	issue_pio_command (c, d->multiple > 0
+			? CMD_WRITE_MULTIPLE : CMD_WRITE_SECTOR_RETRY);
+	for (size_t done = 0; done < cnt; done += block) {
+		size_t n = cnt - done < block ? cnt - done : block;
+
+		if (!wait_while_busy (d))
+			PANIC ("%s: disk write failed, sector=%"PRDSNu,
+					d->name, sec_no + (disk_sector_t) done);
+		while (n-- > 0)
+			output_sector (c, cursor_next (cur));
+		sema_down (&c->completion_wait);
+	}
+}
+
+/* Bus master DMA. */
+
+/* Reads the 32-bit register REG from the configuration space of PCI
+   function FUNC of device DEV on bus BUS. */
+static uint32_t
+pci_read_config (int bus, int dev, int func, int reg) {
+	outl (PCI_CONFIG_ADDR, 0x80000000 | (bus << 16) | (dev << 11)
+			| (func << 8) | (reg & 0xfc));
+	return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes VALUE to the 32-bit register REG of the configuration space
+   of PCI function FUNC of device DEV on bus BUS. */
+static void
+pci_write_config (int bus, int dev, int func, int reg, uint32_t value) {
+	outl (PCI_CONFIG_ADDR, 0x80000000 | (bus << 16) | (dev << 11)
+			| (func << 8) | (reg & 0xfc));
+	outl (PCI_CONFIG_DATA, value);
+}
+
+/* Looks for an IDE controller with bus master support, such as the
+   PIIX in a standard PC, on PCI bus 0.  Enables bus mastering on it
+   and returns the base I/O port of its bus master registers, or 0
+   if there is none. */
+static uint16_t
+find_bus_master (void) {
+	for (int dev = 0; dev < 32; dev++)
+		for (int func = 0; func < 8; func++) {
+			uint32_t id = pci_read_config (0, dev, func, 0x00);
+			if ((id & 0xffff) == 0xffff)
+				continue;
+
+			/* Mass storage controller, IDE, with bus master. */
+			uint32_t class = pci_read_config (0, dev, func, 0x08);
+			if ((class >> 16) != 0x0101 || !(class & 0x8000))
+				continue;
+
+			/* BAR4 holds the bus master registers in I/O space. */
+			uint32_t bar4 = pci_read_config (0, dev, func, 0x20);
+			if (!(bar4 & 1) || (bar4 & 0xfffc) == 0)
+				continue;
+
+			/* Enable I/O space and bus master accesses. */
+			uint32_t command = pci_read_config (0, dev, func, 0x04) & 0xffff;
+			pci_write_config (0, dev, func, 0x04, command | 0x05);
+			return bar4 & 0xfffc;
+		}
+	return 0;
+}
+
+/* Returns true if transfers to D should use DMA. */
+static bool
+use_dma (const struct disk *d) {
+	return d->channel->bm_base != 0 && d->dma;
+}
+
+/* Transfers CNT sectors starting at SEC_NO between disk D and the
+   buffers at CUR by bus master DMA, reading from the disk unless
+   WRITE.  The buffers must be kernel addresses, so that each sector
+   is physically contiguous.  The CPU is free for other threads
+   until the completion interrupt. */
+static void
+dma_transfer (struct disk *d, disk_sector_t sec_no, struct disk_cursor *cur,
+		size_t cnt, bool write) {
+	struct channel *c = d->channel;
+	uint8_t direction = write ? 0 : BM_CMD_READ;
+	struct prd *prd = c->prdt - 1;
+
+	/* Describe the buffers sector by sector, coalescing physically
+	   adjacent ones and splitting at 64 kB boundaries. */
+	for (size_t i = 0; i < cnt; i++) {
+		uint64_t pa = vtop (cursor_next (cur));
+		size_t size = DISK_SECTOR_SIZE;
+
+		ASSERT (pa + size <= (1ULL << 32));
+		while (size > 0) {
+			size_t n = 0x10000 - (pa & 0xffff);
+			if (n > size)
+				n = size;
+			if (prd >= c->prdt && prd->addr + prd->size == pa
+					&& (pa & 0xffff) != 0)
+				prd->size += n;
+			else {
+				prd++;
+				ASSERT ((uint8_t *) (prd + 1) <= (uint8_t *) c->prdt + PGSIZE);
+				prd->addr = pa;
+				prd->size = n;
+				prd->flags = 0;
+			}
+			pa += n;
+			size -= n;
+		}
+	}
+	prd->flags = PRD_EOT;
+
+	outb (c->bm_base + BM_COMMAND, direction);
+	outb (c->bm_base + BM_STATUS,
+			inb (c->bm_base + BM_STATUS) | BM_STA_ERR | BM_STA_INTR);
+	outl (c->bm_base + BM_PRDT, vtop (c->prdt));
+
+	select_sector (d, sec_no, cnt);
+	issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+	outb (c->bm_base + BM_COMMAND, direction | BM_CMD_START);
+	sema_down (&c->completion_wait);
+	outb (c->bm_base + BM_COMMAND, direction);
+
+	if ((inb (c->bm_base + BM_STATUS) & BM_STA_ERR)
+			|| (inb (reg_alt_status (c)) & STA_ERR))
+		PANIC ("%s: disk DMA %s failed, sector=%"PRDSNu,
+				d->name, write ? "write" : "read", sec_no);
+}
+
 /* Low-level ATA primitives. */
 
 /* Wait up to 10 seconds for the controller to become idle, that
@@ -520,6 +1023,9 @@ interrupt_handler (struct intr_frame *f) {
 		if (f->vec_no == c->irq) {
 			if (c->expecting_interrupt) {
 				inb (reg_status (c));               /* Acknowledge interrupt. */
+				if (c->bm_base != 0)
+					outb (c->bm_base + BM_STATUS,
+							inb (c->bm_base + BM_STATUS) | BM_STA_INTR);
 				sema_up (&c->completion_wait);      /* Wake up waiter. */
 			} else
 				printf ("%s: unexpected interrupt\n", c->name);
@@ -0,0 +1,101 @@
+#include "devices/lapic.h"
+#include <debug.h>
+#include "threads/init.h"
+#include "threads/interrupt.h"
+#include "threads/mmu.h"
+#include "threads/pte.h"
+#include "threads/vaddr.h"
+#include "intrinsic.h"
+
+/* The local APIC is the interrupt controller built into the CPU.
+   Pintos leaves external interrupts to the 8259A PICs, which the
+   local APIC passes through on its LINT0 pin; it uses the local
+   APIC only for the timer it contains.  See [IA32-v3a] chapter
+   10 for hardware details. */
+
+/* IA32_APIC_BASE model-specific register. */
+#define MSR_APIC_BASE 0x1b
+#define APIC_BASE_ENABLE 0x800       /* Global enable. */
+
+/* CPUID leaf 1, EDX: the CPU has a local APIC. */
+#define CPUID_APIC (1 << 9)
+
+/* LVT delivery modes. */
+#define LAPIC_DM_NMI 0x400
+#define LAPIC_DM_EXTINT 0x700
+
+/* SVR: software enable. */
+#define LAPIC_SVR_ENABLE 0x100
+
+/* Vector of spurious local APIC interrupts. */
+#define LAPIC_SPURIOUS_VEC 0xff
+
+/* The local APIC's registers, mapped uncached into the kernel's
+   address space.  Null if the CPU has no local APIC. */
+static volatile uint32_t *lapic;
+
+static intr_handler_func lapic_spurious;
+
+/* Maps and enables the local APIC, with every LVT entry but
+   LINT0 and LINT1 masked, so that interrupts keep arriving from
+   the PICs as before.  Returns false, without doing anything, if
+   the CPU has no local APIC. */
+bool
+lapic_init (void) {
+	uint32_t eax = 1, ebx, ecx, edx;
+	uint64_t base, *pte;
+
+	ASSERT (lapic == NULL);
+
+	asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+	if (!(edx & CPUID_APIC))
+		return false;
+
+	base = read_msr (MSR_APIC_BASE);
+	if (!(base & APIC_BASE_ENABLE))
+		write_msr (MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+	base = PTE_ADDR (base);
+
+	/* The mapping lands in the kernel's part of base_pml4, whose
+	   lower-level tables every process page table shares. */
+	pte = pml4e_walk (base_pml4, (uint64_t) ptov (base), 1);
+	if (pte == NULL)
+		return false;
+	*pte = base | PTE_P | PTE_W | PTE_PWT | PTE_PCD;
+	lapic = ptov (base);
+
+	intr_register_int (LAPIC_SPURIOUS_VEC, 0, INTR_OFF, lapic_spurious,
+			"LAPIC Spurious");
+	lapic_write (LAPIC_TPR, 0);
+	lapic_write (LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+	lapic_write (LAPIC_LVT_LINT0, LAPIC_DM_EXTINT);
+	lapic_write (LAPIC_LVT_LINT1, LAPIC_DM_NMI);
+	lapic_write (LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VEC);
+	return true;
+}
+
+/* Returns the value of local APIC register REG. */
+uint32_t
+lapic_read (unsigned reg) {
+	ASSERT (lapic != NULL);
+	return lapic[reg / sizeof *lapic];
+}
+
+/* Sets local APIC register REG to VALUE. */
+void
+lapic_write (unsigned reg, uint32_t value) {
+	ASSERT (lapic != NULL);
+	lapic[reg / sizeof *lapic] = value;
+}
+
+/* Sends an end-of-interrupt signal to the local APIC. */
+void
+lapic_eoi (void) {
+	lapic_write (LAPIC_EOI, 0);
+}
+
+/* Spurious interrupts need no handling, and the local APIC
+   expects no end-of-interrupt signal for them. */
+static void
+lapic_spurious (struct intr_frame *f UNUSED) {
+}
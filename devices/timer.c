@@ -3,6 +3,7 @@
 #include <inttypes.h>
 #include <round.h>
 #include <stdio.h>
+#include "devices/lapic.h"
 #include "threads/interrupt.h"
 #include "threads/io.h"
 #include "threads/synch.h"
@@ -17,14 +18,54 @@
 #error TIMER_FREQ <= 1000 recommended
 #endif
 
+/* 8254 input frequency divided by TIMER_FREQ, rounded to
+   nearest: the number of PIT counts in one timer tick. */
+#define PIT_TICK_COUNT ((1193180 + TIMER_FREQ / 2) / TIMER_FREQ)
+
+/* Longest span, in ticks, that one 16-bit PIT countdown can cover. */
+#define PIT_ONESHOT_MAX (0xffff / PIT_TICK_COUNT)
+
+/* Interrupt vector of the local APIC timer. */
+#define LAPIC_TIMER_VEC 0x30
+
+/* LAPIC_TIMER_DIV setting that divides the bus clock by 16. */
+#define LAPIC_DIV_16 0x3
+
+/* Number of PIT ticks over which the local APIC timer is timed. */
+#define LAPIC_CALIBRATE_TICKS 10
+
 /* Number of timer ticks since OS booted. */
 static int64_t ticks;
 
+/* True once the local APIC timer, rather than the PIT, drives the
+   ticks.  Its 32-bit countdown lets one one-shot countdown cover
+   far more ticks than the PIT's 16-bit one. */
+static bool lapic_timer;
+
+/* Counts of the timer in one tick, and the most ticks that one
+   one-shot countdown can cover. */
+static uint32_t tick_count = PIT_TICK_COUNT;
+static int64_t oneshot_max = PIT_ONESHOT_MAX;
+
+/* While the idle thread has the timer in one-shot mode (see
+   timer_idle_enter()), the number of ticks that end when the
+   countdown does.  Zero while the timer is in periodic mode. */
+static int64_t oneshot_ticks;
+
 /* Number of loops per timer tick.
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
 
 static intr_handler_func timer_interrupt;
+static void timer_use_lapic (void);
+static void timer_set_periodic (void);
+static void timer_set_oneshot (uint32_t count);
+static uint32_t timer_tick_left (void);
+static bool timer_oneshot_left (uint32_t *count);
+static bool timer_pending (void);
+static void pit_set_periodic (void);
+static void pit_set_oneshot (uint16_t count);
+static void timer_advance (int64_t cnt);
 static bool too_many_loops (unsigned loops);
 static void busy_wait (int64_t loops);
 static void real_time_sleep (int64_t num, int32_t denom);
@@ -34,24 +75,20 @@ static void real_time_sleep (int64_t num, int32_t denom);
    corresponding interrupt. */
 void
 timer_init (void) {
-	/* 8254 input frequency divided by TIMER_FREQ, rounded to
-	   nearest. */
-	uint16_t count = (1193180 + TIMER_FREQ / 2) / TIMER_FREQ;
-
-	outb (0x43, 0x34);    /* CW: counter 0, LSB then MSB, mode 2, binary. */
-	outb (0x40, count & 0xff);
-	outb (0x40, count >> 8);
-
+	pit_set_periodic ();
 	intr_register_ext (0x20, timer_interrupt, "8254 Timer");
 }
 
-/* Calibrates loops_per_tick, used to implement brief delays. */
+/* Switches the ticks over to the local APIC timer, if there is
+   one, and calibrates loops_per_tick, used to implement brief
+   delays. */
 void
 timer_calibrate (void) {
 	unsigned high_bit, test_bit;
 
 	ASSERT (intr_get_level () == INTR_ON);
 	printf ("Calibrating timer...  ");
+	timer_use_lapic ();
 
 	/* Approximate loops_per_tick as the largest power-of-two
 	   still less than one timer tick. */
@@ -120,6 +157,65 @@ timer_nsleep (int64_t ns) {
 	real_time_sleep (ns, 1000 * 1000 * 1000);
 }
 
+/* Called by the idle thread, with interrupts off, just before it
+   halts.  Unless a sleeping thread is due within the next tick,
+   switches the timer to one-shot mode so that it interrupts only
+   at the tick boundary at which the next sleeper is due, or after
+   ONESHOT_MAX ticks, whichever comes first.  This spares the
+   halted CPU the ticks in between.  The countdown includes whatever
+   is left of the current tick, so the tick phase is preserved. */
+void
+timer_idle_enter (void) {
+	int64_t cnt;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	if (oneshot_ticks != 0)
+		return;
+	cnt = thread_next_awake () - ticks;
+	if (cnt > oneshot_max)
+		cnt = oneshot_max;
+	if (cnt <= 1 || timer_pending ())
+		return;
+
+	oneshot_ticks = cnt;
+	timer_set_oneshot (timer_tick_left () + (cnt - 1) * tick_count);
+}
+
+/* Called by the idle thread, with interrupts off, when an interrupt
+   other than the timer's ended its halt.  Brings the tick count up
+   to date for the tick boundaries that the one-shot countdown has
+   passed.  The rest of the countdown is shortened to end at the
+   next tick boundary, after which the timer interrupt puts the
+   timer back in periodic mode. */
+void
+timer_idle_exit (void) {
+	uint32_t count;
+	int64_t ahead, passed;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	if (oneshot_ticks <= 1)
+		return;
+
+	/* If the countdown already ran out, its interrupt is pending
+	   and will do the accounting. */
+	if (!timer_oneshot_left (&count))
+		return;
+
+	/* Tick boundaries lie at COUNT values that are multiples of
+	   TICK_COUNT, the last one at zero. */
+	ahead = DIV_ROUND_UP (count, tick_count);
+	passed = oneshot_ticks - ahead;
+	oneshot_ticks = 1;
+	timer_set_oneshot (count - (ahead - 1) * tick_count);
+
+	if (passed > 0) {
+		thread_tick_idle (passed);
+		timer_advance (passed);
+	}
+}
+
 /* Prints timer statistics. */
 void
 timer_print_stats (void) {
@@ -129,23 +225,176 @@ timer_print_stats (void) {
 /* Timer interrupt handler. */
 static void
 timer_interrupt (struct intr_frame *args UNUSED) {
-	ticks++;
+	int64_t cnt = 1;
+
+	/* A one-shot countdown covers ONESHOT_TICKS ticks, all but the
+	   last of them spent halted in the idle thread. */
+	if (oneshot_ticks != 0) {
+		cnt = oneshot_ticks;
+		oneshot_ticks = 0;
+		timer_set_periodic ();
+		thread_tick_idle (cnt - 1);
+	}
 	thread_tick ();
-	/* -------------------- Project 1 -------------------- */
-	if(thread_mlfqs){
-		mlfqs_rec_cpu_inc_per_sec();
-		if(!(timer_ticks() % 4)){
-			mlfqs_prio_calc_all();
-		}
-		if(!(timer_ticks() % TIMER_FREQ)){
-			mlfqs_load_avg_calc();
-			mlfqs_rec_cpu_calc();
+	timer_advance (cnt);
+}
+
+/* Advances the tick count by CNT ticks, doing the per-tick
+   scheduler bookkeeping for each, and wakes the threads that
+   became due. */
+static void
+timer_advance (int64_t cnt) {
+	while (cnt-- > 0) {
+		ticks++;
+		/* -------------------- Project 1 -------------------- */
+		if(thread_mlfqs){
+			mlfqs_rec_cpu_inc_per_sec();
+			if(!(ticks % 4)){
+				mlfqs_prio_calc_all();
+			}
+			if(!(ticks % TIMER_FREQ)){
+				mlfqs_load_avg_calc();
+				mlfqs_rec_cpu_calc();
+			}
 		}
+		/* -------------------- Project 1 -------------------- */
 	}
-	/* -------------------- Project 1 -------------------- */
 	thread_awake(ticks);
 }
 
+/* Times the local APIC timer, if the CPU has one, against
+   LAPIC_CALIBRATE_TICKS ticks of the PIT, then has it drive the
+   ticks in place of the PIT. */
+static void
+timer_use_lapic (void) {
+	enum intr_level old_level;
+	uint32_t count;
+	int64_t start;
+
+	if (!lapic_init ())
+		return;
+
+	/* Count down from the largest count, starting at a tick
+	   boundary, with the timer's interrupt masked. */
+	lapic_write (LAPIC_TIMER_DIV, LAPIC_DIV_16);
+	lapic_write (LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VEC);
+	start = ticks;
+	while (ticks == start)
+		barrier ();
+	lapic_write (LAPIC_TIMER_INIT, UINT32_MAX);
+	start = ticks;
+	while (ticks - start < LAPIC_CALIBRATE_TICKS)
+		barrier ();
+	count = (UINT32_MAX - lapic_read (LAPIC_TIMER_CUR)) / LAPIC_CALIBRATE_TICKS;
+	lapic_write (LAPIC_TIMER_INIT, 0);
+
+	/* A timer coarser than the PIT would gain nothing. */
+	if (count < PIT_TICK_COUNT)
+		return;
+
+	/* Mask IRQ 0, the PIT's, on the master PIC (OCW1) and start
+	   ticking with the local APIC timer. */
+	old_level = intr_disable ();
+	ASSERT (oneshot_ticks == 0);
+	outb (0x21, inb (0x21) | 0x01);
+	lapic_timer = true;
+	tick_count = count;
+	oneshot_max = UINT32_MAX / count;
+	intr_register_lapic (LAPIC_TIMER_VEC, timer_interrupt, "LAPIC Timer");
+	timer_set_periodic ();
+	intr_set_level (old_level);
+}
+
+/* Puts the timer in periodic mode, interrupting TIMER_FREQ times
+   per second. */
+static void
+timer_set_periodic (void) {
+	if (lapic_timer) {
+		lapic_write (LAPIC_LVT_TIMER, LAPIC_LVT_PERIODIC | LAPIC_TIMER_VEC);
+		lapic_write (LAPIC_TIMER_INIT, tick_count);
+	} else
+		pit_set_periodic ();
+}
+
+/* Puts the timer in one-shot mode, interrupting once after COUNT
+   counts. */
+static void
+timer_set_oneshot (uint32_t count) {
+	if (lapic_timer) {
+		lapic_write (LAPIC_LVT_TIMER, LAPIC_TIMER_VEC);
+		lapic_write (LAPIC_TIMER_INIT, count);
+	} else
+		pit_set_oneshot (count);
+}
+
+/* Returns what is left of the current periodic tick, in counts. */
+static uint32_t
+timer_tick_left (void) {
+	uint32_t left;
+
+	if (lapic_timer)
+		left = lapic_read (LAPIC_TIMER_CUR);
+	else {
+		outb (0x43, 0x00);    /* CW: counter 0, latch count. */
+		left = inb (0x40);
+		left |= inb (0x40) << 8;
+	}
+	if (left == 0 || left > tick_count)
+		left = tick_count;
+	return left;
+}
+
+/* Stores what is left of the one-shot countdown in *COUNT and
+   returns true, or returns false if the countdown already ran
+   out. */
+static bool
+timer_oneshot_left (uint32_t *count) {
+	uint8_t status;
+
+	if (lapic_timer) {
+		*count = lapic_read (LAPIC_TIMER_CUR);
+		return *count != 0;
+	}
+
+	outb (0x43, 0xc2);    /* Read-back: status and count of counter 0. */
+	status = inb (0x40);
+	*count = inb (0x40);
+	*count |= inb (0x40) << 8;
+
+	/* OUT high means the countdown ran out. */
+	return !(status & 0x80);
+}
+
+/* Returns true if a timer interrupt is pending, that is, if a
+   tick boundary passed while interrupts were off. */
+static bool
+timer_pending (void) {
+	if (lapic_timer)
+		return lapic_read (LAPIC_IRR + LAPIC_TIMER_VEC / 32 * 0x10)
+			& (1u << LAPIC_TIMER_VEC % 32);
+
+	outb (0x20, 0x0a);    /* OCW3: read the master PIC's IRR. */
+	return inb (0x20) & 0x01;
+}
+
+/* Puts the PIT in periodic mode, interrupting TIMER_FREQ times per
+   second. */
+static void
+pit_set_periodic (void) {
+	outb (0x43, 0x34);    /* CW: counter 0, LSB then MSB, mode 2, binary. */
+	outb (0x40, PIT_TICK_COUNT & 0xff);
+	outb (0x40, PIT_TICK_COUNT >> 8);
+}
+
+/* Puts the PIT in one-shot mode, interrupting once after COUNT
+   input clock cycles. */
+static void
+pit_set_oneshot (uint16_t count) {
+	outb (0x43, 0x30);    /* CW: counter 0, LSB then MSB, mode 0, binary. */
+	outb (0x40, count & 0xff);
+	outb (0x40, count >> 8);
+}
+
 /* Returns true if LOOPS iterations waits for more than one timer
    tick, otherwise false. */
 static bool
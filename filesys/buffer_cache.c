@@ -0,0 +1,214 @@
+/* buffer_cache.c: Write-back cache of file system disk sectors. */
+
+#include "filesys/buffer_cache.h"
+#include <debug.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* A cached disk sector. */
+struct buffer_head {
+	disk_sector_t sector;               /* Cached sector number. */
+	bool valid;                         /* Holds a sector? */
+	bool dirty;                         /* Modified since read from disk? */
+	bool accessed;                      /* Referenced since last clock pass? */
+	uint8_t data[DISK_SECTOR_SIZE];     /* Sector contents. */
+};
+
+static struct buffer_head cache[BUFFER_CACHE_SIZE];
+
+/* Next entry to be examined by the clock replacement. */
+static size_t clock_hand;
+
+/* Protects every entry in the cache. */
+static struct lock cache_lock;
+
+/* Initializes the buffer cache. */
+void
+buffer_cache_init (void) {
+	lock_init (&cache_lock);
+	for (size_t i = 0; i < BUFFER_CACHE_SIZE; i++)
+		cache[i].valid = false;
+	clock_hand = 0;
+}
+
+/* Writes every dirty sector back to the disk. Called when the file
+ * system shuts down. */
+void
+buffer_cache_done (void) {
+	buffer_cache_flush ();
+}
+
+/* Writes BH back to the disk if it was modified. */
+static void
+buffer_head_flush (struct buffer_head *bh) {
+	ASSERT (lock_held_by_current_thread (&cache_lock));
+
+	if (bh->valid && bh->dirty) {
+		disk_write (filesys_disk, bh->sector, bh->data);
+		bh->dirty = false;
+	}
+}
+
+/* Returns the entry holding SECTOR, or a null pointer if SECTOR is
+ * not cached. */
+static struct buffer_head *
+buffer_cache_lookup (disk_sector_t sector) {
+	for (size_t i = 0; i < BUFFER_CACHE_SIZE; i++)
+		if (cache[i].valid && cache[i].sector == sector)
+			return &cache[i];
+	return NULL;
+}
+
+/* Chooses an entry to reuse with the clock algorithm, writing its
+ * old contents back if they are dirty. */
+static struct buffer_head *
+buffer_cache_evict (void) {
+	for (;;) {
+		struct buffer_head *bh = &cache[clock_hand];
+		clock_hand = (clock_hand + 1) % BUFFER_CACHE_SIZE;
+
+		if (!bh->valid)
+			return bh;
+		if (bh->accessed) {
+			bh->accessed = false;
+			continue;
+		}
+		buffer_head_flush (bh);
+		bh->valid = false;
+		return bh;
+	}
+}
+
+/* Returns the entry caching SECTOR, loading it on a miss. If FILL is
+ * false the caller is about to overwrite the whole sector, so the old
+ * contents are not read from the disk. */
+static struct buffer_head *
+buffer_cache_get (disk_sector_t sector, bool fill) {
+	struct buffer_head *bh = buffer_cache_lookup (sector);
+
+	if (bh == NULL) {
+		bh = buffer_cache_evict ();
+		bh->sector = sector;
+		bh->dirty = false;
+		if (fill)
+			disk_read (filesys_disk, sector, bh->data);
+		bh->valid = true;
+	}
+	bh->accessed = true;
+	return bh;
+}
+
+/* Reads SIZE bytes starting at byte OFS of SECTOR into BUFFER. */
+void
+buffer_cache_read (disk_sector_t sector, void *buffer, off_t ofs, off_t size) {
+	ASSERT (ofs >= 0 && size >= 0 && ofs + size <= DISK_SECTOR_SIZE);
+
+	lock_acquire (&cache_lock);
+	struct buffer_head *bh = buffer_cache_get (sector, true);
+	memcpy (buffer, bh->data + ofs, size);
+	lock_release (&cache_lock);
+}
+
+/* Writes SIZE bytes from BUFFER into SECTOR starting at byte OFS.
+ * The sector reaches the disk when it is evicted or flushed. */
+void
+buffer_cache_write (disk_sector_t sector, const void *buffer, off_t ofs,
+		off_t size) {
+	ASSERT (ofs >= 0 && size >= 0 && ofs + size <= DISK_SECTOR_SIZE);
+
+	lock_acquire (&cache_lock);
+	struct buffer_head *bh =
+		buffer_cache_get (sector, ofs != 0 || size != DISK_SECTOR_SIZE);
+	memcpy (bh->data + ofs, buffer, size);
+	bh->dirty = true;
+	lock_release (&cache_lock);
+}
+
+/* Reads CNT whole sectors starting at SECTOR into BUFFER. Cached
+ * sectors are copied from the cache; each run of uncached sectors
+ * is read from the disk with one command, bypassing the cache.
+ * BUFFER must be kernel memory: the disk transfers into it while
+ * the cache and channel locks are held. */
+void
+buffer_cache_read_multi (disk_sector_t sector, void *buffer_, size_t cnt) {
+	uint8_t *buffer = buffer_;
+	size_t i = 0;
+
+	ASSERT (is_kernel_vaddr (buffer));
+
+	lock_acquire (&cache_lock);
+	while (i < cnt) {
+		struct buffer_head *bh = buffer_cache_lookup (sector + i);
+		if (bh != NULL) {
+			bh->accessed = true;
+			memcpy (buffer + i * DISK_SECTOR_SIZE, bh->data, DISK_SECTOR_SIZE);
+			i++;
+			continue;
+		}
+
+		size_t run = 1;
+		while (i + run < cnt && buffer_cache_lookup (sector + i + run) == NULL)
+			run++;
+		disk_read_multi (filesys_disk, sector + i,
+				buffer + i * DISK_SECTOR_SIZE, run);
+		i += run;
+	}
+	lock_release (&cache_lock);
+}
+
+/* Writes CNT whole sectors from BUFFER starting at SECTOR. Cached
+ * sectors are updated in the cache; each run of uncached sectors is
+ * written to the disk with one command, bypassing the cache. BUFFER
+ * must be kernel memory, as for buffer_cache_read_multi(). */
+void
+buffer_cache_write_multi (disk_sector_t sector, const void *buffer_,
+		size_t cnt) {
+	const uint8_t *buffer = buffer_;
+	size_t i = 0;
+
+	ASSERT (is_kernel_vaddr (buffer));
+
+	lock_acquire (&cache_lock);
+	while (i < cnt) {
+		struct buffer_head *bh = buffer_cache_lookup (sector + i);
+		if (bh != NULL) {
+			bh->accessed = true;
+			memcpy (bh->data, buffer + i * DISK_SECTOR_SIZE, DISK_SECTOR_SIZE);
+			bh->dirty = true;
+			i++;
+			continue;
+		}
+
+		size_t run = 1;
+		while (i + run < cnt && buffer_cache_lookup (sector + i + run) == NULL)
+			run++;
+		disk_write_multi (filesys_disk, sector + i,
+				buffer + i * DISK_SECTOR_SIZE, run);
+		i += run;
+	}
+	lock_release (&cache_lock);
+}
+
+/* Writes all dirty sectors back to the disk. The writes are queued
+ * together, so that the disk can sort and merge them. */
+void
+buffer_cache_flush (void) {
+	static struct disk_request requests[BUFFER_CACHE_SIZE];
+	size_t cnt = 0;
+
+	lock_acquire (&cache_lock);
+	for (size_t i = 0; i < BUFFER_CACHE_SIZE; i++) {
+		struct buffer_head *bh = &cache[i];
+		if (bh->valid && bh->dirty) {
+			disk_request_init (&requests[cnt], filesys_disk, bh->sector,
+					bh->data, 1, true);
+			disk_submit (&requests[cnt++]);
+			bh->dirty = false;
+		}
+	}
+	for (size_t i = 0; i < cnt; i++)
+		disk_wait (&requests[i]);
+	lock_release (&cache_lock);
+}
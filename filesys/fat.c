@@ -3,6 +3,7 @@
 #include "filesys/filesys.h"
 #include "threads/malloc.h"
 #include "threads/synch.h"
+#include <bitmap.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -24,12 +25,15 @@ struct fat_fs {
 	disk_sector_t data_start;
 	cluster_t last_clst;
 	struct lock write_lock;
+	struct bitmap *free_map;    /* In-use clusters, one bit per cluster. */
+	cluster_t next_fit;         /* Cluster to search for free space from. */
 };
 
 static struct fat_fs *fat_fs;
 
 void fat_boot_create (void);
 void fat_fs_init (void);
+static void fat_free_map_init (void);
 
 void
 fat_init (void) {
@@ -78,6 +82,7 @@ fat_open (void) {
 			free (bounce);
 		}
 	}
+	fat_free_map_init ();
 }
 
 void
@@ -123,6 +128,7 @@ fat_create (void) {
 	fat_fs->fat = calloc (fat_fs->fat_length, sizeof (cluster_t));
 	if (fat_fs->fat == NULL)
 		PANIC ("FAT creation failed");
+	fat_free_map_init ();
 
 	// Set up ROOT_DIR_CLST
 	fat_put (ROOT_DIR_CLUSTER, EOChain);
@@ -170,26 +176,97 @@ fat_fs_init (void) {
 /* FAT handling                                                               */
 /*----------------------------------------------------------------------------*/
 
+/* Builds the free-cluster map from the FAT, replacing any earlier
+ * one. Formatting builds it in fat_create() and again in fat_open().
+ * Clusters 0 and 1 are never handed out. */
+static void
+fat_free_map_init (void) {
+	if (fat_fs->free_map != NULL)
+		bitmap_destroy (fat_fs->free_map);
+	fat_fs->free_map = bitmap_create (fat_fs->fat_length);
+	if (fat_fs->free_map == NULL)
+		PANIC ("FAT free map creation failed");
+
+	bitmap_set_multiple (fat_fs->free_map, 0, 2, true);
+	for (cluster_t i = 2; i < fat_fs->fat_length; i++)
+		if (fat_fs->fat[i] != 0)
+			bitmap_mark (fat_fs->free_map, i);
+	fat_fs->next_fit = 2;
+}
+
+/* Finds free clusters, starting from the next-fit cursor and
+ * wrapping around once. Returns the first cluster of a run of at
+ * most *CNT free clusters and stores the run's length in *CNT, or
+ * returns 0 if the disk is full. */
+static cluster_t
+fat_find_free (size_t *cnt) {
+	size_t start = bitmap_scan (fat_fs->free_map, fat_fs->next_fit, 1, false);
+	if (start == BITMAP_ERROR)
+		start = bitmap_scan (fat_fs->free_map, 2, 1, false);
+	if (start == BITMAP_ERROR)
+		return 0;
+
+	size_t run = 1;
+	while (run < *cnt && start + run < fat_fs->fat_length
+			&& !bitmap_test (fat_fs->free_map, start + run))
+		run++;
+	*cnt = run;
+
+	fat_fs->next_fit = start + run;
+	if (fat_fs->next_fit >= fat_fs->fat_length)
+		fat_fs->next_fit = 2;
+	return start;
+}
+
 /* Add a cluster to the chain.
  * If CLST is 0, start a new chain.
  * Returns 0 if fails to allocate a new cluster. */
 cluster_t
 fat_create_chain (cluster_t clst) {
-	/* TODO: Your code goes here. */
-	int i;
-	// What if clst == 1?
-	for (i = 2; fat_get(i) != 0; i++)
-	{
-		if (i == fat_fs->last_clst)
-			return 0; // Fail
-	}
+	return fat_create_chain_n (clst, 1);
+}
+
+/* Add CNT clusters to the chain, contiguous on the disk as far as
+ * free space allows.
+ * If CLST is 0, start a new chain.
+ * Returns the first new cluster, or 0 without allocating anything if
+ * there are fewer than CNT free clusters. */
+cluster_t
+fat_create_chain_n (cluster_t clst, size_t cnt) {
+	cluster_t first = 0;
+	cluster_t prev = clst;
 
-	fat_put(i, EOChain);
+	ASSERT (cnt > 0);
 
-	if (clst != 0)
-		fat_put(clst, i);
+	lock_acquire (&fat_fs->write_lock);
+	while (cnt > 0) {
+		size_t run = cnt;
+		cluster_t start = fat_find_free (&run);
+		if (start == 0) {
+			/* Give back what was taken so far. */
+			if (clst != 0)
+				fat_put (clst, EOChain);
+			while (first != 0 && first != EOChain) {
+				cluster_t next = fat_get (first);
+				fat_put (first, 0);
+				first = next;
+			}
+			lock_release (&fat_fs->write_lock);
+			return 0;
+		}
 
-	return i;
+		for (cluster_t c = start; c < start + run; c++) {
+			fat_put (c, EOChain);
+			if (prev != 0)
+				fat_put (prev, c);
+			prev = c;
+		}
+		if (first == 0)
+			first = start;
+		cnt -= run;
+	}
+	lock_release (&fat_fs->write_lock);
+	return first;
 }
 
 /* Remove the chain of clusters starting from CLST.
@@ -197,6 +274,7 @@ fat_create_chain (cluster_t clst) {
 void
 fat_remove_chain (cluster_t clst, cluster_t pclst) {
 	/* TODO: Your code goes here. */
+	lock_acquire (&fat_fs->write_lock);
 	if(pclst){
 		fat_put(pclst, EOChain);
 	}
@@ -206,11 +284,12 @@ fat_remove_chain (cluster_t clst, cluster_t pclst) {
 		while (true){
 			nclst = fat_get(clst);
 			fat_put(clst, 0);
-			if (nclst == EOChain)
-				return;
+			if (nclst == EOChain || nclst == 0)
+				break;
 			clst = nclst;
 		}
 	}
+	lock_release (&fat_fs->write_lock);
 }
 
 /* Update a value in the FAT table. */
@@ -218,6 +297,8 @@ void
 fat_put (cluster_t clst, cluster_t val) {
 	/* TODO: Your code goes here. */
 	fat_fs->fat[clst] = val;
+	if (fat_fs->free_map != NULL && clst >= 2)
+		bitmap_set (fat_fs->free_map, clst, val != 0);
 }
 
 /* Fetch a value in the FAT table. */
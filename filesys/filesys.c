@@ -6,6 +6,10 @@
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/buffer_cache.h"
+#ifdef EFILESYS
+#include "filesys/page_cache.h"
+#endif
 #include "devices/disk.h"
 #include "filesys/fat.h"
 #include "threads/thread.h"
@@ -23,6 +27,7 @@ filesys_init (bool format) {
 	if (filesys_disk == NULL)
 		PANIC ("hd0:1 (hdb) not present, file system initialization failed");
 
+	buffer_cache_init ();
 	inode_init ();
 
 #ifdef EFILESYS
@@ -49,6 +54,11 @@ filesys_init (bool format) {
  * to disk. */
 void
 filesys_done (void) {
+#ifdef EFILESYS
+	page_cache_flush ();
+#endif
+	buffer_cache_done ();
+
 	/* Original FS */
 #ifdef EFILESYS
 	fat_close ();
@@ -6,11 +6,20 @@
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
 #include "filesys/fat.h"
+#include "filesys/buffer_cache.h"
+#ifdef EFILESYS
+#include "filesys/page_cache.h"
+#endif
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Whole sectors that fit in one bounce page. */
+#define BOUNCE_SECTORS (PGSIZE / DISK_SECTOR_SIZE)
+
 /* Returns the number of sectors to allocate for an inode SIZE
  * bytes long. */
 static inline size_t
@@ -18,23 +27,104 @@ bytes_to_sectors (off_t size) {
 	return DIV_ROUND_UP (size, DISK_SECTOR_SIZE);
 }
 
+/* Maps data sectors of INODE until sector index IDX is covered or
+ * the end of the cluster chain is reached. The chain only ever grows
+ * at its end, so the map is extended from where it stopped rather
+ * than rebuilt. */
+static void
+inode_map_extend (struct inode *inode, off_t idx) {
+	ASSERT (lock_held_by_current_thread (&inode->map_lock));
+
+	cluster_t last;
+	if (inode->extent_cnt == 0) {
+		if (!inode->data.start)
+			return;
+		last = sector_to_cluster (inode->data.start);
+		inode->extents = malloc (4 * sizeof *inode->extents);
+		if (inode->extents == NULL)
+			PANIC ("inode extent map allocation failed");
+		inode->extent_cap = 4;
+		inode->extents[0] = (struct inode_extent) {
+			.idx = 0, .start = inode->data.start, .len = 1 };
+		inode->extent_cnt = inode->mapped_cnt = 1;
+	} else {
+		struct inode_extent *e = &inode->extents[inode->extent_cnt - 1];
+		last = sector_to_cluster (e->start + e->len - 1);
+	}
+
+	while (inode->mapped_cnt <= idx) {
+		cluster_t clst = fat_get (last);
+		if (clst == 0 || clst == EOChain)
+			break;
+
+		struct inode_extent *e = &inode->extents[inode->extent_cnt - 1];
+		if (clst == last + 1)
+			e->len++;
+		else {
+			if (inode->extent_cnt == inode->extent_cap) {
+				size_t cap = inode->extent_cap * 2;
+				struct inode_extent *extents =
+					realloc (inode->extents, cap * sizeof *extents);
+				if (extents == NULL)
+					PANIC ("inode extent map allocation failed");
+				inode->extents = extents;
+				inode->extent_cap = cap;
+			}
+			inode->extents[inode->extent_cnt++] = (struct inode_extent) {
+				.idx = inode->mapped_cnt, .start = cluster_to_sector (clst),
+				.len = 1 };
+		}
+		inode->mapped_cnt++;
+		last = clst;
+	}
+}
+
 /* Returns the disk sector that contains byte offset POS within
- * INODE.
+ * INODE, and stores in *RUN the number of sectors from there that
+ * are contiguous on the disk.
  * Returns -1 if INODE does not contain data for a byte at offset
  * POS. */
 static disk_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) {
+byte_to_sector (struct inode *inode, off_t pos, off_t *run) {
 	ASSERT (inode != NULL);
+	*run = 0;
 	if(pos < inode_length(inode)){
-		cluster_t clst = sector_to_cluster(inode->data.start);
-		for(off_t i = 0; i < pos / DISK_SECTOR_SIZE; i++){
-			clst = fat_get(clst);
+		off_t idx = pos / DISK_SECTOR_SIZE;
+		disk_sector_t sector = -1;
+
+		lock_acquire (&inode->map_lock);
+		inode_map_extend (inode, idx);
+		if (idx < inode->mapped_cnt) {
+			size_t lo = 0, hi = inode->extent_cnt;
+			while (hi - lo > 1) {
+				size_t mid = (lo + hi) / 2;
+				if (inode->extents[mid].idx <= idx)
+					lo = mid;
+				else
+					hi = mid;
+			}
+			struct inode_extent *e = &inode->extents[lo];
+			sector = e->start + (idx - e->idx);
+			*run = e->len - (idx - e->idx);
 		}
-		return cluster_to_sector(clst);
+		lock_release (&inode->map_lock);
+		return sector;
 	}
 	return -1;
 }
 
+/* Returns how many whole sectors a transfer of SIZE bytes can move
+ * at once, given INODE_LEFT bytes left in the inode, a starting byte
+ * offset of SECTOR_OFS within the sector, and RUN contiguous sectors
+ * on the disk. */
+static inline off_t
+inode_sectors_run (off_t size, off_t inode_left, int sector_ofs, off_t run) {
+	if (sector_ofs != 0)
+		return 0;
+	off_t whole = (size < inode_left ? size : inode_left) / DISK_SECTOR_SIZE;
+	return whole < run ? whole : run;
+}
+
 /* List of open inodes, so that opening a single inode twice
  * returns the same `struct inode'. */
 static struct list open_inodes;
@@ -68,37 +158,21 @@ inode_create (disk_sector_t sector, off_t length, bool is_dir) {
 		disk_inode->magic = INODE_MAGIC;
 		disk_inode->is_dir = is_dir;
 		
-		bool chain_succ = true;
+		/* The data clusters follow the inode's own cluster in its
+		 * chain, with one spare cluster at the end. */
 		cluster_t clst = sector_to_cluster(sector);
-		cluster_t pclst;
-		cluster_t cclst = clst;
-		cluster_t nclst;
-		int cnt = 0;
-
-		while (cnt <= sectors)
-		{
-			nclst = fat_create_chain(cclst);
-			if (!nclst)
-			{
-				chain_succ = false;
-				fat_remove_chain(clst, 0);
-				break;
-			}
-			pclst = cclst;
-			cclst = nclst;
-			cnt += 1;
-		}
+		bool chain_succ = fat_create_chain_n (clst, sectors + 1) != 0;
 		disk_inode->start = cluster_to_sector(fat_get(clst));
 
 		if (chain_succ) {
-			disk_write (filesys_disk, sector, disk_inode);
+			buffer_cache_write (sector, disk_inode, 0, DISK_SECTOR_SIZE);
 			if (sectors > 0) {
 				static char zeros[DISK_SECTOR_SIZE];
 				disk_sector_t start = disk_inode->start;
 
 				for (int i = 0; i < sectors; i++)
 				{
-					disk_write(filesys_disk, start, zeros);
+					buffer_cache_write (start, zeros, 0, DISK_SECTOR_SIZE);
 					start = cluster_to_sector(fat_get(sector_to_cluster(start)));
 				}
 			}
@@ -138,7 +212,12 @@ inode_open (disk_sector_t sector) {
 	inode->open_cnt = 1;
 	inode->deny_write_cnt = 0;
 	inode->removed = false;
-	disk_read (filesys_disk, inode->sector, &inode->data);
+	inode->readahead_pos = 0;
+	lock_init (&inode->map_lock);
+	inode->extents = NULL;
+	inode->extent_cnt = inode->extent_cap = 0;
+	inode->mapped_cnt = 0;
+	buffer_cache_read (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
 	return inode;
 }
 
@@ -170,12 +249,19 @@ inode_close (struct inode *inode) {
 		/* Remove from inode list and release lock. */
 		list_remove (&inode->elem);
 
+#ifdef EFILESYS
+		/* Drop its cached pages, which need not reach the disk if the
+		 * blocks are about to be freed. */
+		page_cache_release (inode, !inode->removed);
+#endif
+
 		/* Deallocate blocks if removed. */
 		if (inode->removed) {
 			fat_remove_chain(sector_to_cluster(inode->sector), 0);
 			//fat_remove_chain(sector_to_cluster(inode->data.start), 0);
 		}
 
+		free (inode->extents);
 		free (inode); 
 	}
 }
@@ -192,20 +278,44 @@ inode_remove (struct inode *inode) {
  * Returns the number of bytes actually read, which may be less
  * than SIZE if an error occurs or end of file is reached. */
 off_t
-inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
-	uint8_t *buffer = buffer_;
-	off_t bytes_read = 0;
-	uint8_t *bounce = NULL;
-
+inode_read_at (struct inode *inode, void *buffer, off_t size, off_t offset) {
 	/* growth */
 	if(offset > inode_length(inode)){
 		return 0;
 	}
 	/* growth */
 
+#ifdef EFILESYS
+	if (page_cache_enabled ())
+		return page_cache_read_at (inode, buffer, size, offset);
+#endif
+	return inode_read_sectors_at (inode, buffer, size, offset);
+}
+
+/* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET,
+ * directly from the buffer cache, bypassing the page cache.
+ *
+ * The buffer cache and the disk driver take kernel buffers only,
+ * because a page fault on a user buffer while they hold their locks
+ * could deadlock. A user BUFFER is therefore filled through a kernel
+ * bounce page, copied out with none of those locks held. */
+off_t
+inode_read_sectors_at (struct inode *inode, void *buffer_, off_t size,
+		off_t offset) {
+	uint8_t *buffer = buffer_;
+	uint8_t *bounce = NULL;
+	off_t bytes_read = 0;
+
+	if (!is_kernel_vaddr (buffer)) {
+		bounce = palloc_get_page (0);
+		if (bounce == NULL)
+			return 0;
+	}
+
 	while (size > 0) {
 		/* Disk sector to read, starting byte offset within sector. */
-		disk_sector_t sector_idx = byte_to_sector (inode, offset);
+		off_t run;
+		disk_sector_t sector_idx = byte_to_sector (inode, offset, &run);
 		int sector_ofs = offset % DISK_SECTOR_SIZE;
 
 		/* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -218,28 +328,28 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
 		if (chunk_size <= 0)
 			break;
 
-		if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) {
-			/* Read full sector directly into caller's buffer. */
-			disk_read (filesys_disk, sector_idx, buffer + bytes_read); 
-		} else {
-			/* Read sector into bounce buffer, then partially copy
-			 * into caller's buffer. */
-			if (bounce == NULL) {
-				bounce = malloc (DISK_SECTOR_SIZE);
-				if (bounce == NULL)
-					break;
-			}
-			disk_read (filesys_disk, sector_idx, bounce);
-			memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-		}
+		/* Whole sectors that are contiguous on the disk are read
+		 * together; anything else goes through the buffer cache a
+		 * sector at a time. */
+		off_t whole = inode_sectors_run (size, inode_left, sector_ofs, run);
+		uint8_t *dst = bounce != NULL ? bounce : buffer + bytes_read;
+		if (bounce != NULL && whole > BOUNCE_SECTORS)
+			whole = BOUNCE_SECTORS;
+		if (whole > 1) {
+			chunk_size = whole * DISK_SECTOR_SIZE;
+			buffer_cache_read_multi (sector_idx, dst, whole);
+		} else
+			buffer_cache_read (sector_idx, dst, sector_ofs, chunk_size);
+		if (bounce != NULL)
+			memcpy (buffer + bytes_read, bounce, chunk_size);
 
 		/* Advance. */
 		size -= chunk_size;
 		offset += chunk_size;
 		bytes_read += chunk_size;
 	}
-	free (bounce);
 
+	palloc_free_page (bounce);
 	return bytes_read;
 }
 
@@ -249,35 +359,59 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
  * (Normally a write at end of file would extend the inode, but
  * growth is not yet implemented.) */
 off_t
-inode_write_at (struct inode *inode, const void *buffer_, off_t size,
+inode_write_at (struct inode *inode, const void *buffer, off_t size,
 		off_t offset) {
-	const uint8_t *buffer = buffer_;
-	off_t bytes_written = 0;
-	uint8_t *bounce = NULL;
-
 	if (inode->deny_write_cnt)
 		return 0;
 
 	/* growth */
-	size_t added_size = 0;
-	cluster_t clst = sector_to_cluster(inode->data.start);
-	while(fat_get(clst) != 0 && fat_get(clst) != EOChain){
-		clst = fat_get(clst);
-		added_size++;
-	}
 	if(inode_length(inode) < offset + size){
-		size_t added_sectors = bytes_to_sectors(offset + size) - added_size;
-		for(size_t i = 0; i < added_sectors; i++){
-			clst = fat_create_chain(clst);
+		/* The chain keeps one spare cluster past the data. */
+		off_t needed = bytes_to_sectors(offset + size) + 1;
+		lock_acquire (&inode->map_lock);
+		inode_map_extend (inode, needed);
+		if (inode->mapped_cnt < needed) {
+			struct inode_extent *e = &inode->extents[inode->extent_cnt - 1];
+			cluster_t tail = sector_to_cluster (e->start + e->len - 1);
+			if (fat_create_chain_n (tail, needed - inode->mapped_cnt) == 0) {
+				lock_release (&inode->map_lock);
+				return 0;
+			}
 		}
+		lock_release (&inode->map_lock);
 		inode->data.length = offset + size;
-		disk_write(filesys_disk, inode->sector, &inode->data);
+		buffer_cache_write (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
 	}
 	/* growth */
 
+#ifdef EFILESYS
+	if (page_cache_enabled ())
+		return page_cache_write_at (inode, buffer, size, offset);
+#endif
+	return inode_write_sectors_at (inode, buffer, size, offset);
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+ * directly into the buffer cache, bypassing the page cache. INODE
+ * must already be long enough. A user BUFFER is staged through a
+ * kernel bounce page, as in inode_read_sectors_at(). */
+off_t
+inode_write_sectors_at (struct inode *inode, const void *buffer_, off_t size,
+		off_t offset) {
+	const uint8_t *buffer = buffer_;
+	uint8_t *bounce = NULL;
+	off_t bytes_written = 0;
+
+	if (!is_kernel_vaddr (buffer)) {
+		bounce = palloc_get_page (0);
+		if (bounce == NULL)
+			return 0;
+	}
+
 	while (size > 0) {
 		/* Sector to write, starting byte offset within sector. */
-		disk_sector_t sector_idx = byte_to_sector (inode, offset);
+		off_t run;
+		disk_sector_t sector_idx = byte_to_sector (inode, offset, &run);
 		int sector_ofs = offset % DISK_SECTOR_SIZE;
 
 		/* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -290,35 +424,30 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 		if (chunk_size <= 0)
 			break;
 
-		if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) {
-			/* Write full sector directly to disk. */
-			disk_write (filesys_disk, sector_idx, buffer + bytes_written); 
-		} else {
-			/* We need a bounce buffer. */
-			if (bounce == NULL) {
-				bounce = malloc (DISK_SECTOR_SIZE);
-				if (bounce == NULL)
-					break;
-			}
-
-			/* If the sector contains data before or after the chunk
-			   we're writing, then we need to read in the sector
-			   first.  Otherwise we start with a sector of all zeros. */
-			if (sector_ofs > 0 || chunk_size < sector_left) 
-				disk_read (filesys_disk, sector_idx, bounce);
-			else
-				memset (bounce, 0, DISK_SECTOR_SIZE);
-			memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-			disk_write (filesys_disk, sector_idx, bounce); 
-		}
+		/* Whole sectors that are contiguous on the disk are written
+		 * together.  Otherwise copy the chunk into the buffer cache.  A
+		 * partial sector is read in first; a whole sector is simply
+		 * overwritten. */
+		off_t whole = inode_sectors_run (size, inode_left, sector_ofs, run);
+		const uint8_t *src = bounce != NULL ? bounce : buffer + bytes_written;
+		if (bounce != NULL && whole > BOUNCE_SECTORS)
+			whole = BOUNCE_SECTORS;
+		if (whole > 1)
+			chunk_size = whole * DISK_SECTOR_SIZE;
+		if (bounce != NULL)
+			memcpy (bounce, buffer + bytes_written, chunk_size);
+		if (whole > 1)
+			buffer_cache_write_multi (sector_idx, src, whole);
+		else
+			buffer_cache_write (sector_idx, src, sector_ofs, chunk_size);
 
 		/* Advance. */
 		size -= chunk_size;
 		offset += chunk_size;
 		bytes_written += chunk_size;
 	}
-	free (bounce);
 
+	palloc_free_page (bounce);
 	return bytes_written;
 }
 
@@ -349,10 +478,5 @@ inode_length (const struct inode *inode) {
 
 bool
 inode_is_dir(struct inode* inode){
-	bool res;
-	struct inode_disk *disk_inode = calloc(1, sizeof (struct inode_disk));
-	disk_read(filesys_disk, inode->sector, disk_inode);
-	res = disk_inode->is_dir;
-	free(disk_inode);
-	return res;
+	return inode->data.is_dir;
 }
@@ -1,9 +1,38 @@
 /* page_cache.c: Implementation of Page Cache (Buffer Cache). */
 
 #include "vm/vm.h"
+#ifdef EFILESYS
+#include <debug.h>
+#include <round.h>
+#include <string.h>
+#include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "devices/timer.h"
+
+/* Pages read ahead of a sequential reader. */
+#define PAGE_CACHE_READAHEAD 4
+
+/* Dirty pages that make the worker write back the cache. */
+#define PAGE_CACHE_DIRTY_MAX (PAGE_CACHE_SIZE / 4)
+
+/* Longest time a page may stay dirty before it is written back. */
+#define PAGE_CACHE_WRITEBACK_TICKS (5 * TIMER_FREQ)
+
+/* How often the flusher checks for dirty pages past their time,
+ * while there are any. */
+#define PAGE_CACHE_FLUSH_TICKS TIMER_FREQ
+
 static bool page_cache_readahead (struct page *page, void *kva);
 static bool page_cache_writeback (struct page *page);
 static void page_cache_destroy (struct page *page);
+static void page_cache_kworkerd (void *aux);
+static void page_cache_kflushd (void *aux);
+static uint64_t page_cache_hash (const struct hash_elem *e, void *aux);
+static bool page_cache_less (const struct hash_elem *a,
+		const struct hash_elem *b, void *aux);
 
 /* DO NOT MODIFY this struct */
 static const struct page_operations page_cache_op = {
@@ -15,10 +44,61 @@ static const struct page_operations page_cache_op = {
 
 tid_t page_cache_workerd;
 
+/* A page queued for read-ahead by the worker. */
+struct readahead_request {
+	struct inode *inode;
+	size_t idx;
+	struct list_elem elem;
+};
+
+/* Cached pages, least recently used first, and the same pages
+ * keyed by inode and page index. */
+static struct list lru_list;
+static struct hash page_table;
+static size_t page_cnt;
+
+/* Dirty pages and the time the oldest of them became dirty.
+ * DIRTY_COND is signaled when the first page becomes dirty. */
+static size_t dirty_cnt;
+static int64_t dirty_since;
+static struct condition dirty_cond;
+
+/* Work for the worker thread. */
+static struct list readahead_queue;
+static bool writeback_requested;
+static struct semaphore kworker_sema;
+
+/* Protects everything above. */
+static struct lock page_cache_lock;
+
+static bool initialized;
+
 /* The initializer of file vm */
 void
 pagecache_init (void) {
-	/* TODO: Create a worker daemon for page cache with page_cache_kworkerd */
+	list_init (&lru_list);
+	hash_init (&page_table, page_cache_hash, page_cache_less, NULL);
+	list_init (&readahead_queue);
+	lock_init (&page_cache_lock);
+	sema_init (&kworker_sema, 0);
+	cond_init (&dirty_cond);
+	page_cnt = dirty_cnt = 0;
+	writeback_requested = false;
+
+	page_cache_workerd = thread_create ("kworkerd", PRI_DEFAULT + 1,
+			page_cache_kworkerd, NULL);
+	if (page_cache_workerd == TID_ERROR)
+		return;
+	if (thread_create ("kflushd", PRI_DEFAULT + 1, page_cache_kflushd, NULL)
+			== TID_ERROR)
+		return;
+	initialized = true;
+}
+
+/* Returns true if file data should go through the page cache. */
+bool
+page_cache_enabled (void) {
+	return initialized;
 }
 
 /* Initialize the page cache */
@@ -27,24 +107,593 @@ page_cache_initializer (struct page *page, enum vm_type type, void *kva) {
 	/* Set up the handler */
 	page->operations = &page_cache_op;
 
+	struct page_cache *pc = &page->page_cache;
+	pc->inode = NULL;
+	pc->idx = 0;
+	pc->kva = kva;
+	pc->dirty = false;
+	pc->busy = false;
+	pc->pin_cnt = 0;
+	cond_init (&pc->io_done);
+	return true;
 }
 
 /* Utilze the Swap in mechanism to implement readhead */
 static bool
 page_cache_readahead (struct page *page, void *kva) {
+	struct page_cache *pc = &page->page_cache;
+	off_t read = inode_read_sectors_at (pc->inode, kva, PGSIZE,
+			pc->idx * PGSIZE);
+
+	memset ((uint8_t *) kva + read, 0, PGSIZE - read);
+	return true;
 }
 
-/* Utilze the Swap out mechanism to implement writeback */
+/* Utilze the Swap out mechanism to implement writeback. Called
+ * with page_cache_lock released; the caller keeps PAGE busy and
+ * updates its dirty state. */
 static bool
 page_cache_writeback (struct page *page) {
+	struct page_cache *pc = &page->page_cache;
+	off_t ofs = pc->idx * PGSIZE;
+	off_t size = inode_length (pc->inode) - ofs;
+
+	if (size > PGSIZE)
+		size = PGSIZE;
+	return size <= 0
+		|| inode_write_sectors_at (pc->inode, pc->kva, size, ofs) == size;
 }
 
 /* Destory the page_cache. */
 static void
 page_cache_destroy (struct page *page) {
+	struct page_cache *pc = &page->page_cache;
+
+	ASSERT (!pc->busy && pc->pin_cnt == 0);
+	if (pc->dirty)
+		dirty_cnt--;
+	list_remove (&pc->elem);
+	hash_delete (&page_table, &pc->hash_elem);
+	page_cnt--;
+	palloc_free_page (pc->kva);
+}
+
+/* Returns true if no thread is reading, writing back or copying
+ * PAGE, so that it may be written back or dropped. */
+static bool
+page_cache_idle (struct page *page) {
+	return !page->page_cache.busy && page->page_cache.pin_cnt == 0;
+}
+
+/* Lets the current thread access the contents of PAGE with
+ * page_cache_lock released, until page_cache_unpin(). */
+static void
+page_cache_pin (struct page *page) {
+	page->page_cache.pin_cnt++;
+}
+
+/* Ends an access begun by page_cache_pin(). */
+static void
+page_cache_unpin (struct page *page) {
+	struct page_cache *pc = &page->page_cache;
+
+	ASSERT (pc->pin_cnt > 0);
+	if (--pc->pin_cnt == 0)
+		cond_broadcast (&pc->io_done, &page_cache_lock);
+}
+
+/* Writes back the pages in BATCH, which the caller has marked busy,
+ * with page_cache_lock released, then marks them idle again and the
+ * written ones clean. Returns false if any write failed; those pages
+ * stay dirty. */
+static bool
+page_cache_write_batch (struct list *batch) {
+	struct list written, failed;
+
+	ASSERT (lock_held_by_current_thread (&page_cache_lock));
+	if (list_empty (batch))
+		return true;
+
+	list_init (&written);
+	list_init (&failed);
+	lock_release (&page_cache_lock);
+	while (!list_empty (batch)) {
+		struct page *page = list_entry (list_pop_front (batch), struct page,
+				page_cache.io_elem);
+		list_push_back (swap_out (page) ? &written : &failed,
+				&page->page_cache.io_elem);
+	}
+	lock_acquire (&page_cache_lock);
+
+	bool success = list_empty (&failed);
+	while (!list_empty (&written)) {
+		struct page *page = list_entry (list_pop_front (&written), struct page,
+				page_cache.io_elem);
+		page->page_cache.dirty = false;
+		dirty_cnt--;
+		list_push_back (&failed, &page->page_cache.io_elem);
+	}
+	while (!list_empty (&failed)) {
+		struct page *page = list_entry (list_pop_front (&failed), struct page,
+				page_cache.io_elem);
+		page->page_cache.busy = false;
+		cond_broadcast (&page->page_cache.io_done, &page_cache_lock);
+	}
+	return success;
+}
+
+/* Writes PAGE back if it is dirty. PAGE must be idle. The lock is
+ * released during the write, but PAGE is idle again on return.
+ * Returns false, leaving PAGE dirty, if the write fails. */
+static bool
+page_cache_clean (struct page *page) {
+	struct list batch;
+
+	ASSERT (page_cache_idle (page));
+	if (!page->page_cache.dirty)
+		return true;
+	list_init (&batch);
+	page->page_cache.busy = true;
+	list_push_back (&batch, &page->page_cache.io_elem);
+	return page_cache_write_batch (&batch);
+}
+
+/* Drops PAGE, which must be idle, from the cache. Any unwritten
+ * data is lost. */
+static void
+page_cache_drop (struct page *page) {
+	destroy (page);
+	free (page);
+}
+
+/* Drops the least recently used idle page, writing it back first if
+ * it is dirty. A page whose writeback fails is kept and moved to the
+ * back of the LRU list. Returns false if no page could be dropped. */
+static bool
+page_cache_evict (void) {
+	for (size_t tries = page_cnt; tries > 0; tries--) {
+		struct page *page = NULL;
+		struct list_elem *e;
+
+		for (e = list_begin (&lru_list); e != list_end (&lru_list);
+				e = list_next (e)) {
+			struct page *p = list_entry (e, struct page, page_cache.elem);
+			if (page_cache_idle (p)) {
+				page = p;
+				break;
+			}
+		}
+		if (page == NULL)
+			return false;
+
+		if (page_cache_clean (page)) {
+			page_cache_drop (page);
+			return true;
+		}
+		list_remove (&page->page_cache.elem);
+		list_push_back (&lru_list, &page->page_cache.elem);
+	}
+	return false;
+}
+
+/* Returns a hash value for cached page E. */
+static uint64_t
+page_cache_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct page_cache *pc = hash_entry (e, struct page_cache, hash_elem);
+	return hash_bytes (&pc->inode, sizeof pc->inode) ^ hash_int (pc->idx);
+}
+
+/* Orders cached pages A and B by inode and page index. */
+static bool
+page_cache_less (const struct hash_elem *a_, const struct hash_elem *b_,
+		void *aux UNUSED) {
+	const struct page_cache *a = hash_entry (a_, struct page_cache, hash_elem);
+	const struct page_cache *b = hash_entry (b_, struct page_cache, hash_elem);
+
+	if (a->inode != b->inode)
+		return a->inode < b->inode;
+	return a->idx < b->idx;
+}
+
+/* Returns the cached page IDX of INODE, or a null pointer. */
+static struct page *
+page_cache_lookup (struct inode *inode, size_t idx) {
+	struct page_cache key;
+	struct hash_elem *e;
+
+	key.inode = inode;
+	key.idx = idx;
+	e = hash_find (&page_table, &key.hash_elem);
+	return e != NULL
+		? hash_entry (e, struct page, page_cache.hash_elem) : NULL;
+}
+
+/* Returns a new page for the cache, making room for it first. The
+ * lock may be released meanwhile. */
+static struct page *
+page_cache_alloc (void) {
+	/* Pages that cannot be written back stay cached, so the cache may
+	 * briefly run over its size. */
+	if (page_cnt >= PAGE_CACHE_SIZE)
+		page_cache_evict ();
+
+	void *kva = palloc_get_page (0);
+	struct page *page = malloc (sizeof *page);
+	while ((kva == NULL || page == NULL) && page_cache_evict ()) {
+		if (kva == NULL)
+			kva = palloc_get_page (0);
+		if (page == NULL)
+			page = malloc (sizeof *page);
+	}
+	if (kva == NULL || page == NULL)
+		PANIC ("page cache: out of memory");
+
+	page->va = NULL;
+	page->frame = NULL;
+	page_cache_initializer (page, VM_PAGE_CACHE, kva);
+	return page;
+}
+
+/* Frees PAGE, from page_cache_alloc(), which was never inserted. */
+static void
+page_cache_free (struct page *page) {
+	palloc_free_page (page->page_cache.kva);
+	free (page);
+}
+
+/* Adds PAGE, from page_cache_alloc(), to the cache as page IDX of
+ * INODE. If FILL, the page is read from the disk with the lock
+ * released, and is busy meanwhile; otherwise it is zeroed. */
+static void
+page_cache_insert (struct page *page, struct inode *inode, size_t idx,
+		bool fill) {
+	struct page_cache *pc = &page->page_cache;
+
+	pc->inode = inode;
+	pc->idx = idx;
+	list_push_back (&lru_list, &pc->elem);
+	hash_insert (&page_table, &pc->hash_elem);
+	page_cnt++;
+
+	if (!fill) {
+		memset (pc->kva, 0, PGSIZE);
+		return;
+	}
+	pc->busy = true;
+	lock_release (&page_cache_lock);
+	swap_in (page, pc->kva);
+	lock_acquire (&page_cache_lock);
+	pc->busy = false;
+	cond_broadcast (&pc->io_done, &page_cache_lock);
+}
+
+/* Returns page IDX of INODE, bringing it into the cache on a miss.
+ * If FILL is false the caller overwrites the whole valid part of
+ * the page, so it is zeroed instead of read from the disk. A page
+ * that is being read or written back is waited for. */
+static struct page *
+page_cache_get (struct inode *inode, size_t idx, bool fill) {
+	ASSERT (lock_held_by_current_thread (&page_cache_lock));
+
+	for (;;) {
+		struct page *page = page_cache_lookup (inode, idx);
+		if (page != NULL && page->page_cache.busy) {
+			cond_wait (&page->page_cache.io_done, &page_cache_lock);
+			continue;
+		}
+		if (page != NULL) {
+			list_remove (&page->page_cache.elem);
+			list_push_back (&lru_list, &page->page_cache.elem);
+			return page;
+		}
+
+		page = page_cache_alloc ();
+		/* Another thread may have brought the page in meanwhile. */
+		if (page_cache_lookup (inode, idx) != NULL) {
+			page_cache_free (page);
+			continue;
+		}
+		page_cache_insert (page, inode, idx, fill);
+		return page;
+	}
+}
+
+/* Marks PAGE modified. */
+static void
+page_cache_set_dirty (struct page *page) {
+	if (!page->page_cache.dirty) {
+		page->page_cache.dirty = true;
+		if (dirty_cnt++ == 0) {
+			dirty_since = timer_ticks ();
+			cond_signal (&dirty_cond, &page_cache_lock);
+		}
+	}
+}
+
+/* Queues the pages following page IDX of INODE for read-ahead.
+ * Returns true if anything was queued. */
+static bool
+page_cache_queue_readahead (struct inode *inode, size_t idx) {
+	size_t last = DIV_ROUND_UP (inode_length (inode), PGSIZE);
+	bool queued = false;
+
+	for (size_t i = idx + 1; i <= idx + PAGE_CACHE_READAHEAD && i < last; i++) {
+		struct list_elem *e;
+
+		if (page_cache_lookup (inode, i) != NULL)
+			continue;
+		for (e = list_begin (&readahead_queue); e != list_end (&readahead_queue);
+				e = list_next (e)) {
+			struct readahead_request *r =
+				list_entry (e, struct readahead_request, elem);
+			if (r->inode == inode && r->idx == i)
+				break;
+		}
+		if (e != list_end (&readahead_queue))
+			continue;
+
+		struct readahead_request *r = malloc (sizeof *r);
+		if (r == NULL)
+			break;
+		r->inode = inode;
+		r->idx = i;
+		list_push_back (&readahead_queue, &r->elem);
+		queued = true;
+	}
+	return queued;
+}
+
+/* Returns true if the dirty pages should be written back now. */
+static bool
+page_cache_writeback_due (void) {
+	if (dirty_cnt == 0 || writeback_requested)
+		return false;
+	return dirty_cnt >= PAGE_CACHE_DIRTY_MAX
+		|| timer_elapsed (dirty_since) >= PAGE_CACHE_WRITEBACK_TICKS;
+}
+
+/* Reads SIZE bytes from INODE into BUFFER, starting at position
+ * OFFSET, through the page cache. Sequential readers have the
+ * following pages read ahead by the worker thread. Each page is
+ * copied out pinned, with the lock released. */
+off_t
+page_cache_read_at (struct inode *inode, void *buffer_, off_t size,
+		off_t offset) {
+	uint8_t *buffer = buffer_;
+	off_t bytes_read = 0;
+	bool wake = false;
+
+	lock_acquire (&page_cache_lock);
+	bool sequential = offset == inode->readahead_pos;
+	while (size > 0) {
+		size_t idx = offset / PGSIZE;
+		int page_ofs = offset % PGSIZE;
+
+		/* Bytes left in inode, bytes left in page, lesser of the two. */
+		off_t inode_left = inode_length (inode) - offset;
+		int page_left = PGSIZE - page_ofs;
+		int min_left = inode_left < page_left ? inode_left : page_left;
+
+		int chunk_size = size < min_left ? size : min_left;
+		if (chunk_size <= 0)
+			break;
+
+		struct page *page = page_cache_get (inode, idx, true);
+		page_cache_pin (page);
+		lock_release (&page_cache_lock);
+		memcpy (buffer + bytes_read, (uint8_t *) page->page_cache.kva + page_ofs,
+				chunk_size);
+		lock_acquire (&page_cache_lock);
+		page_cache_unpin (page);
+
+		size -= chunk_size;
+		offset += chunk_size;
+		bytes_read += chunk_size;
+	}
+	inode->readahead_pos = offset;
+	if (sequential && bytes_read > 0)
+		wake = page_cache_queue_readahead (inode, (offset - 1) / PGSIZE);
+	if (page_cache_writeback_due ())
+		wake = writeback_requested = true;
+	lock_release (&page_cache_lock);
+
+	if (wake)
+		sema_up (&kworker_sema);
+	return bytes_read;
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+ * through the page cache. INODE must already be long enough. The
+ * data reaches the disk when the worker writes it back, when the
+ * page is evicted, or when INODE is closed. Each page is copied in
+ * pinned, with the lock released. */
+off_t
+page_cache_write_at (struct inode *inode, const void *buffer_, off_t size,
+		off_t offset) {
+	const uint8_t *buffer = buffer_;
+	off_t bytes_written = 0;
+	bool wake = false;
+
+	lock_acquire (&page_cache_lock);
+	while (size > 0) {
+		size_t idx = offset / PGSIZE;
+		int page_ofs = offset % PGSIZE;
+
+		/* Bytes left in inode, bytes left in page, lesser of the two. */
+		off_t inode_left = inode_length (inode) - offset;
+		int page_left = PGSIZE - page_ofs;
+		int min_left = inode_left < page_left ? inode_left : page_left;
+
+		int chunk_size = size < min_left ? size : min_left;
+		if (chunk_size <= 0)
+			break;
+
+		/* A page that is overwritten up to its end or the end of the
+		 * file need not be read in first. */
+		bool whole = page_ofs == 0 && chunk_size == min_left;
+		struct page *page = page_cache_get (inode, idx, !whole);
+		page_cache_pin (page);
+		lock_release (&page_cache_lock);
+		memcpy ((uint8_t *) page->page_cache.kva + page_ofs,
+				buffer + bytes_written, chunk_size);
+		lock_acquire (&page_cache_lock);
+		page_cache_set_dirty (page);
+		page_cache_unpin (page);
+
+		size -= chunk_size;
+		offset += chunk_size;
+		bytes_written += chunk_size;
+	}
+	if (page_cache_writeback_due ())
+		wake = writeback_requested = true;
+	lock_release (&page_cache_lock);
+
+	if (wake)
+		sema_up (&kworker_sema);
+	return bytes_written;
+}
+
+/* Returns a cached page of INODE, or a null pointer. */
+static struct page *
+page_cache_find_inode (struct inode *inode) {
+	struct list_elem *e;
+
+	for (e = list_begin (&lru_list); e != list_end (&lru_list);
+			e = list_next (e)) {
+		struct page *page = list_entry (e, struct page, page_cache.elem);
+		if (page->page_cache.inode == inode)
+			return page;
+	}
+	return NULL;
+}
+
+/* Drops every page of INODE from the cache, writing dirty pages
+ * back first if WRITEBACK. Called when INODE is closed for the last
+ * time. Pages that are being read or written back are waited for. */
+void
+page_cache_release (struct inode *inode, bool writeback) {
+	struct list_elem *e;
+	struct page *page;
+
+	if (!initialized)
+		return;
+
+	lock_acquire (&page_cache_lock);
+	for (e = list_begin (&readahead_queue); e != list_end (&readahead_queue);) {
+		struct readahead_request *r =
+			list_entry (e, struct readahead_request, elem);
+		e = list_next (e);
+		if (r->inode == inode) {
+			list_remove (&r->elem);
+			free (r);
+		}
+	}
+	while ((page = page_cache_find_inode (inode)) != NULL) {
+		if (!page_cache_idle (page))
+			cond_wait (&page->page_cache.io_done, &page_cache_lock);
+		else if (!writeback || page_cache_clean (page))
+			page_cache_drop (page);
+		else {
+			/* The page holds the only copy of its data and INODE is
+			 * going away, so retry until the write goes through. */
+			lock_release (&page_cache_lock);
+			timer_sleep (1);
+			lock_acquire (&page_cache_lock);
+		}
+	}
+	lock_release (&page_cache_lock);
+}
+
+/* Writes every dirty idle page back, with the lock released during
+ * the writes. */
+static void
+page_cache_writeback_all (void) {
+	struct list batch;
+	struct list_elem *e;
+
+	ASSERT (lock_held_by_current_thread (&page_cache_lock));
+	list_init (&batch);
+	for (e = list_begin (&lru_list); e != list_end (&lru_list);
+			e = list_next (e)) {
+		struct page *page = list_entry (e, struct page, page_cache.elem);
+		if (page->page_cache.dirty && page_cache_idle (page)) {
+			page->page_cache.busy = true;
+			list_push_back (&batch, &page->page_cache.io_elem);
+		}
+	}
+	page_cache_write_batch (&batch);
+}
+
+/* Writes every dirty page back. Called when the file system shuts
+ * down. */
+void
+page_cache_flush (void) {
+	if (!initialized)
+		return;
+
+	lock_acquire (&page_cache_lock);
+	page_cache_writeback_all ();
+	lock_release (&page_cache_lock);
+}
+
+/* Flusher thread for page cache: has the worker write back dirty
+ * pages that are past their time, even when the cache sits idle.
+ * Sleeps without waking up while no page is dirty. */
+static void
+page_cache_kflushd (void *aux UNUSED) {
+	for (;;) {
+		bool wake = false;
+
+		lock_acquire (&page_cache_lock);
+		while (dirty_cnt == 0)
+			cond_wait (&dirty_cond, &page_cache_lock);
+		lock_release (&page_cache_lock);
+
+		timer_sleep (PAGE_CACHE_FLUSH_TICKS);
+		lock_acquire (&page_cache_lock);
+		if (page_cache_writeback_due ())
+			wake = writeback_requested = true;
+		lock_release (&page_cache_lock);
+		if (wake)
+			sema_up (&kworker_sema);
+	}
 }
 
 /* Worker thread for page cache */
 static void
-page_cache_kworkerd (void *aux) {
+page_cache_kworkerd (void *aux UNUSED) {
+	for (;;) {
+		sema_down (&kworker_sema);
+
+		/* Serve the read-ahead requests one at a time. Each page is
+		 * read with the lock released, so readers can get at pages
+		 * that are already cached in between. */
+		lock_acquire (&page_cache_lock);
+		while (!list_empty (&readahead_queue)) {
+			/* Allocating may release the lock, so a request is taken
+			 * off the queue only afterward; page_cache_release() must
+			 * not miss one whose inode it is about to free. */
+			struct page *page = page_cache_alloc ();
+			if (list_empty (&readahead_queue)) {
+				page_cache_free (page);
+				break;
+			}
+			struct readahead_request *r = list_entry (
+					list_pop_front (&readahead_queue),
+					struct readahead_request, elem);
+			if ((off_t) (r->idx * PGSIZE) < inode_length (r->inode)
+					&& page_cache_lookup (r->inode, r->idx) == NULL)
+				page_cache_insert (page, r->inode, r->idx, true);
+			else
+				page_cache_free (page);
+			free (r);
+		}
+
+		if (writeback_requested) {
+			page_cache_writeback_all ();
+			writeback_requested = false;
+		}
+		lock_release (&page_cache_lock);
+	}
 }
+#endif /* EFILESYS */
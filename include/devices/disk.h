@@ -2,7 +2,11 @@
 #define DEVICES_DISK_H
 
 #include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <list.h>
+#include "threads/synch.h"
 
 /* Size of a disk sector in bytes. */
 #define DISK_SECTOR_SIZE 512
@@ -15,6 +19,28 @@ typedef uint32_t disk_sector_t;
  * printf ("sector=%"PRDSNu"\n", sector); */
 #define PRDSNu PRIu32
 
+/* If true, use bus master DMA when available.
+ * Controlled by kernel command-line option "-dma". */
+extern bool disk_dma;
+
+/* A transfer queued on a disk's channel.  The channel's dispatcher
+ * thread carries out requests in elevator order, merging requests
+ * that are adjacent on the disk into one command. */
+struct disk_request {
+	struct disk *disk;              /* Disk to transfer to or from. */
+	disk_sector_t sec_no;           /* First sector. */
+	size_t cnt;                     /* Number of sectors. */
+	void *buffer;                   /* CNT * DISK_SECTOR_SIZE bytes. */
+	bool write;                     /* Write to the disk? Else read. */
+	struct semaphore done;          /* Up'd when done. */
+	struct list_elem elem;          /* Element in the channel's queue. */
+};
+
+/* Buffers passed to the functions below must be kernel memory.
+ * A transfer may be done by DMA, which addresses the buffer
+ * physically through vtop(), and a PIO transfer is carried out by
+ * the channel's dispatcher thread, which cannot reach the
+ * submitter's user pages. */
 void disk_init (void);
 void disk_print_stats (void);
 
@@ -22,6 +48,13 @@ struct disk *disk_get (int chan_no, int dev_no);
 disk_sector_t disk_size (struct disk *);
 void disk_read (struct disk *, disk_sector_t, void *);
 void disk_write (struct disk *, disk_sector_t, const void *);
+void disk_read_multi (struct disk *, disk_sector_t, void *, size_t cnt);
+void disk_write_multi (struct disk *, disk_sector_t, const void *, size_t cnt);
+
+void disk_request_init (struct disk_request *, struct disk *, disk_sector_t,
+		void *buffer, size_t cnt, bool write);
+void disk_submit (struct disk_request *);
+void disk_wait (struct disk_request *);
 
 void 	register_disk_inspect_intr ();
 #endif /* devices/disk.h */
@@ -0,0 +1,30 @@
+#ifndef DEVICES_LAPIC_H
+#define DEVICES_LAPIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Local APIC registers, as offsets from its base address.  See
+   [IA32-v3a] chapter 10 "Advanced Programmable Interrupt
+   Controller (APIC)". */
+#define LAPIC_TPR 0x080          /* Task priority. */
+#define LAPIC_EOI 0x0b0          /* End of interrupt. */
+#define LAPIC_SVR 0x0f0          /* Spurious interrupt vector. */
+#define LAPIC_IRR 0x200          /* Interrupt requests, 8 x 32 bits. */
+#define LAPIC_LVT_TIMER 0x320    /* LVT timer entry. */
+#define LAPIC_LVT_LINT0 0x350    /* LVT LINT0 entry. */
+#define LAPIC_LVT_LINT1 0x360    /* LVT LINT1 entry. */
+#define LAPIC_TIMER_INIT 0x380   /* Timer initial count. */
+#define LAPIC_TIMER_CUR 0x390    /* Timer current count. */
+#define LAPIC_TIMER_DIV 0x3e0    /* Timer divide configuration. */
+
+/* LVT entry bits. */
+#define LAPIC_LVT_MASKED 0x10000     /* 1=interrupt masked. */
+#define LAPIC_LVT_PERIODIC 0x20000   /* Timer: 1=periodic, 0=one-shot. */
+
+bool lapic_init (void);
+uint32_t lapic_read (unsigned reg);
+void lapic_write (unsigned reg, uint32_t value);
+void lapic_eoi (void);
+
+#endif /* devices/lapic.h */
@@ -0,0 +1,19 @@
+#ifndef FILESYS_BUFFER_CACHE_H
+#define FILESYS_BUFFER_CACHE_H
+
+#include <stdbool.h>
+#include "filesys/off_t.h"
+#include "devices/disk.h"
+
+/* Number of sectors held by the buffer cache. */
+#define BUFFER_CACHE_SIZE 64
+
+void buffer_cache_init (void);
+void buffer_cache_done (void);
+void buffer_cache_read (disk_sector_t, void *, off_t ofs, off_t size);
+void buffer_cache_write (disk_sector_t, const void *, off_t ofs, off_t size);
+void buffer_cache_read_multi (disk_sector_t, void *, size_t cnt);
+void buffer_cache_write_multi (disk_sector_t, const void *, size_t cnt);
+void buffer_cache_flush (void);
+
+#endif /* filesys/buffer_cache.h */
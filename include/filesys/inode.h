@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include "filesys/off_t.h"
 #include "devices/disk.h"
+#include "threads/synch.h"
 
 struct bitmap;
 
@@ -18,6 +19,13 @@ struct inode_disk {
 	uint32_t unused[124];               /* Not used. */
 };
 
+/* A run of data sectors that are contiguous on the disk. */
+struct inode_extent {
+	off_t idx;                          /* First sector index within the file. */
+	disk_sector_t start;                /* Disk sector of sector IDX. */
+	off_t len;                          /* Number of sectors. */
+};
+
 /* In-memory inode. */
 struct inode {
 	struct list_elem elem;              /* Element in inode list. */
@@ -26,6 +34,14 @@ struct inode {
 	bool removed;                       /* True if deleted, false otherwise. */
 	int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
 	struct inode_disk data;             /* Inode content. */
+	off_t readahead_pos;                /* Next offset of a sequential reader. */
+
+	/* Cached map of the data cluster chain, extended on demand. */
+	struct lock map_lock;               /* Protects the fields below. */
+	struct inode_extent *extents;       /* Extents in file order. */
+	size_t extent_cnt;                  /* Number of extents in use. */
+	size_t extent_cap;                  /* Number of extents allocated. */
+	off_t mapped_cnt;                   /* Sectors covered by EXTENTS. */
 };
 
 void inode_init (void);
@@ -37,6 +53,9 @@ void inode_close (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+off_t inode_read_sectors_at (struct inode *, void *, off_t size, off_t offset);
+off_t inode_write_sectors_at (struct inode *, const void *, off_t size,
+		off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
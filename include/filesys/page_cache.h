@@ -1,12 +1,42 @@
 #ifndef FILESYS_PAGE_CACHE_H
 #define FILESYS_PAGE_CACHE_H
-#include "vm/vm.h"
+#include <hash.h>
+#include <list.h>
+#include <stddef.h>
+#include "filesys/off_t.h"
+#include "threads/synch.h"
 
 struct page;
 enum vm_type;
+struct inode;
+
+/* Number of file pages held by the page cache. */
+#define PAGE_CACHE_SIZE 64
 
-struct page_cache {};
+/* A page of file data held by the page cache. */
+struct page_cache {
+	struct inode *inode;        /* File the page belongs to. */
+	size_t idx;                 /* Page index within the file. */
+	void *kva;                  /* Kernel page holding the contents. */
+	bool dirty;                 /* Modified since read from disk? */
+	bool busy;                  /* Being read or written back? */
+	unsigned pin_cnt;           /* Threads copying to or from KVA. */
+	struct condition io_done;   /* Signaled when busy or pinned ends. */
+	struct list_elem elem;      /* Element in the LRU list. */
+	struct list_elem io_elem;   /* Element in a writeback batch. */
+	struct hash_elem hash_elem; /* Element in the lookup table. */
+};
+
+/* vm/vm.h embeds struct page_cache in struct page, so it is included
+ * only once the struct is complete. */
+#include "vm/vm.h"
 
-void page_cache_init (void);
+void pagecache_init (void);
 bool page_cache_initializer (struct page *page, enum vm_type type, void *kva);
+bool page_cache_enabled (void);
+off_t page_cache_read_at (struct inode *, void *, off_t size, off_t offset);
+off_t page_cache_write_at (struct inode *, const void *, off_t size,
+		off_t offset);
+void page_cache_release (struct inode *, bool writeback);
+void page_cache_flush (void);
 #endif
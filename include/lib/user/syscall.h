@@ -13,6 +13,9 @@ typedef int pid_t;
 typedef int off_t;
 #define MAP_FAILED ((void *) NULL)
 
+/* Or into mmap's WRITABLE argument to ask for 2 MB pages. */
+#define MAP_HUGE 2
+
 /* Maximum characters in a filename written by readdir(). */
 #define READDIR_MAX_LEN 14
 
@@ -114,6 +114,7 @@ struct thread {
 	struct lock *want_to_acquire;		/* Lock that this thread want_to_acquire */
 	int nice;							/* Nice value. */
 	int recent_cpu;						/* Recent cpu value. */
+	int64_t rec_cpu_stamp;				/* Last second recent_cpu was decayed for. */
 	/* -------------------- Project 1 -------------------- */
 
 	/* -------------------- Project 2 -------------------- */
@@ -155,6 +156,8 @@ void thread_init (void);
 void thread_start (void);
 
 void thread_tick (void);
+void thread_tick_idle (int64_t cnt);
+int64_t thread_idle_ticks (void);
 void thread_print_stats (void);
 
 typedef void thread_func (void *aux);
@@ -164,6 +167,7 @@ bool priority_less(const struct list_elem *, const struct list_elem *, void *);
 
 void thread_block (void);
 void thread_unblock (struct thread *);
+void thread_change_priority (struct thread *, int priority);
 
 struct thread *thread_current (void);
 tid_t thread_tid (void);
@@ -173,6 +177,7 @@ void thread_exit (void) NO_RETURN;
 void thread_yield (void);
 void thread_sleep(int64_t start, int64_t ticks);
 void thread_awake(int64_t ticks);
+int64_t thread_next_awake (void);
 
 int thread_get_priority (void);
 void thread_set_priority (int);
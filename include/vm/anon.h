@@ -1,14 +1,21 @@
 #ifndef VM_ANON_H
 #define VM_ANON_H
+#include <stddef.h>
 #include "vm/vm.h"
 struct page;
 enum vm_type;
 
+/* Swap slot of a page that is not swapped out. */
+#define SWAP_SLOT_NONE ((size_t) -1)
+
 struct anon_page {
-    struct thread *thread;
+    size_t slot;                /* Swap slot holding the page, or
+                                   SWAP_SLOT_NONE. */
 };
 
 void vm_anon_init (void);
 bool anon_initializer (struct page *page, enum vm_type type, void *kva);
+void anon_share_slot (struct page *dst, struct page *src);
+void anon_release_slots (struct page **pages, size_t cnt);
 
 #endif
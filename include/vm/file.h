@@ -5,6 +5,23 @@
 
 struct page;
 enum vm_type;
+struct supplemental_page_table;
+
+/* A file region mapped by mmap. The pages of the region are added to
+ * the spt only when they are first touched. */
+struct vma {
+	void *start;           /* First page of the mapping. */
+	void *end;             /* Page following the mapping. */
+	struct file *file;     /* File reopened for the mapping. */
+	off_t ofs;             /* File offset mapped at START. */
+	size_t length;         /* Bytes of the file mapped. */
+	bool writable;
+	bool huge;             /* Back with 2 MB pages where possible. */
+};
+
+/* Bit of mmap's WRITABLE argument asking for 2 MB pages; MAP_HUGE in
+ * lib/user/syscall.h. */
+#define MMAP_HUGE 2
 
 struct file_page {
 	struct file *file;
@@ -17,4 +34,10 @@ bool file_backed_initializer (struct page *page, enum vm_type type, void *kva);
 void *do_mmap(void *addr, size_t length, int writable,
 		struct file *file, off_t offset);
 void do_munmap (void *va);
+bool file_backed_writeback (struct page *page);
+struct vma *vma_find (struct supplemental_page_table *spt, void *va);
+bool vma_materialize (struct vma *vma, void *va, size_t cnt);
+bool vma_copy (struct supplemental_page_table *dst,
+		struct supplemental_page_table *src);
+void vma_destroy_all (struct supplemental_page_table *spt);
 #endif
@@ -37,6 +37,15 @@ struct thread;
 
 #define VM_TYPE(type) ((type) & 7)
 
+/* Marks a page lazily loaded from the file region described by its
+ * struct file_information aux, so that faults on it can populate the
+ * following pages of the region too. */
+#define VM_FILE_REGION VM_MARKER_0
+
+/* Hints that the page may be backed by part of a 2 MB page, if its
+ * whole aligned 2 MB region is hinted and untouched. */
+#define VM_HUGE VM_MARKER_1
+
 /* The representation of "page".
  * This is kind of "parent class", which has four "child class"es, which are
  * uninit_page, file_page, anon_page, and page cache (project4).
@@ -48,9 +57,14 @@ struct page {
 
 	/* Your implementation */
 	/* Project 3*/
-	struct hash_elem elem;
+	/* A read-only executable page keeps how it is loaded once it has
+	 * turned anonymous, so that its frame can be dropped and the
+	 * page loaded again, or shared from the text cache. */
 	struct file_information *file_inf;
+	vm_initializer *file_init;
 	bool writable;
+	struct thread *owner;  /* Thread whose address space holds the page. */
+	struct list_elem frame_elem;  /* Element in the frame's page list. */
 
 	/* Per-type data are binded into the union.
 	 * Each function automatically detects the current union */
@@ -67,8 +81,24 @@ struct page {
 /* The representation of "frame" */
 struct frame {
 	void *kva;
-	struct page *page;
-	struct list_elem frame_elem;
+	struct list pages;     /* Pages mapping the frame; more than one
+	                          share it copy-on-write. */
+	size_t ref_cnt;        /* Number of pages in PAGES. */
+	bool pinned;           /* Being filled, must not be evicted. */
+	bool writeback;        /* Being written to its file with the frame
+	                          lock released; see vm_writeback_begin(). */
+	bool huge;             /* Mapped as part of a 2 MB page. */
+	uint8_t age;           /* Reference history over the last scans,
+	                          most recent in the top bit. */
+	void *split_pt;        /* In the first frame of a 2 MB page, the
+	                          page table to split its mapping into. */
+
+	/* Read-only executable page held by the frame, shared by every
+	 * process that maps it. TEXT_INODE is null if there is none. */
+	struct inode *text_inode;
+	off_t text_ofs;
+	uint32_t text_len;
+	struct hash_elem text_elem;  /* Element in the text page cache. */
 };
 
 /* The function table for page operations.
@@ -87,11 +117,43 @@ struct page_operations {
 #define destroy(page) \
 	if ((page)->operations->destroy) (page)->operations->destroy (page)
 
+/* Fault-around state of a process. While a fault is being handled,
+ * BUF holds LEN bytes of INODE read from offset OFS, from which the
+ * pages of the window are filled. */
+struct fault_around {
+	void *next;            /* Page following the last window. */
+	size_t window;         /* Pages to populate on the next fault. */
+	struct inode *inode;
+	off_t ofs;
+	off_t len;
+	uint8_t *buf;
+};
+
+/* Memory use of a process. */
+struct vm_stats {
+	size_t rss;            /* Resident pages. */
+	size_t wss;            /* Resident pages referenced recently: the
+	                          working set. */
+	unsigned fault_rate;   /* Page faults in the last full scan
+	                          period. */
+};
+
 /* Representation of current process's memory space.
  * We don't want to force you to obey any specific design for this struct.
  * All designs up to you for this. */
+/* The pages are kept in a radix tree shaped like the x86-64 page
+ * table: four levels of page-sized nodes indexed by the PML4, PDPE,
+ * PDX and PTX fields of the address, whose leaves point to struct
+ * page. ROOT is null while the table is empty. */
 struct supplemental_page_table {
-	struct hash *spt_hash;
+	void *root;
+	struct vma **vmas;     /* Mappings, sorted by address. */
+	size_t vma_cnt;
+	size_t vma_cap;
+	struct fault_around around;
+	struct vm_stats stats;
+	unsigned faults;       /* Page faults in the current period. */
+	int64_t fault_period;  /* Start of the current period, in ticks. */
 };
 
 #include "threads/thread.h"
@@ -101,6 +163,7 @@ bool supplemental_page_table_copy (struct supplemental_page_table *dst,
 void supplemental_page_table_kill (struct supplemental_page_table *spt);
 struct page *spt_find_page (struct supplemental_page_table *spt,
 		void *va);
+struct page *spt_next_page (struct supplemental_page_table *spt, void *va);
 bool spt_insert_page (struct supplemental_page_table *spt, struct page *page);
 void spt_remove_page (struct supplemental_page_table *spt, struct page *page);
 
@@ -113,8 +176,17 @@ bool vm_try_handle_fault (struct intr_frame *f, void *addr, bool user,
 bool vm_alloc_page_with_initializer (enum vm_type type, void *upage,
 		bool writable, vm_initializer *init, void *aux);
 void vm_dealloc_page (struct page *page);
+void vm_free_frame (struct page *page);
+void vm_writeback_begin (void);
+void vm_writeback_end (void);
 bool vm_claim_page (void *va);
 enum vm_type page_get_type (struct page *page);
+off_t vm_file_read (struct file *file, void *buffer, off_t size, off_t ofs);
+void vm_get_stats (struct thread *t, struct vm_stats *stats);
+
+/* If true, print each process's memory use when it exits.
+ * Controlled by kernel command-line option "-vmstats". */
+extern bool vm_stats_on_exit;
 
 /* Project 3 */
 
@@ -124,10 +196,4 @@ struct file_information{
 	uint32_t read_bytes;
 };
 
-struct mmap_information{
-	struct list_elem elem;
-	uint64_t begin;
-	uint64_t end;
-};
-
 #endif  /* VM_VM_H */
@@ -0,0 +1,62 @@
+/* Sleeps with no other thread to run, so that the CPU idles with
+   the periodic timer stopped, for durations shorter than, as long
+   as and longer than the 5 ticks that one one-shot countdown
+   covers when the PIT drives the ticks.  Verifies that each sleep ends exactly on its
+   tick, and that the idle thread is charged with exactly the ticks
+   slept through and none of the ticks spent busy. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/init.h"
+#include "threads/thread.h"
+#include "devices/timer.h"
+
+/* Sleep durations, in ticks. */
+static const int durations[] = {2, 5, 6, 11, 64, 333};
+#define DURATION_CNT ((int) (sizeof durations / sizeof *durations))
+
+/* Ticks spent busy, then asleep, while counting idle ticks. */
+#define PACE_TICKS 100
+
+void
+test_alarm_idle (void)
+{
+  int64_t busy, idle;
+  int64_t start;
+  int i;
+
+  msg ("Sleeping with no other thread to run.");
+  for (i = 0; i < DURATION_CNT; i++)
+    {
+      /* Make sure we're at the beginning of a timer tick. */
+      timer_sleep (1);
+
+      start = timer_ticks ();
+      timer_sleep (durations[i]);
+      msg ("slept %d ticks: woke up after %d ticks",
+           durations[i], (int) (timer_ticks () - start));
+    }
+
+  /* Spin through some ticks, keeping the periodic timer running. */
+  timer_sleep (1);
+  busy = thread_idle_ticks ();
+  start = timer_ticks ();
+  while (timer_ticks () - start < PACE_TICKS)
+    continue;
+  busy = thread_idle_ticks () - busy;
+
+  /* Sleep through as many, with the CPU idle. */
+  timer_sleep (1);
+  idle = thread_idle_ticks ();
+  timer_sleep (PACE_TICKS);
+  idle = thread_idle_ticks () - idle;
+
+  if (busy != 0)
+    fail ("%d busy ticks included %lld idle ticks",
+          PACE_TICKS, (long long) busy);
+  if (idle != PACE_TICKS)
+    fail ("%d ticks asleep were %lld idle ticks",
+          PACE_TICKS, (long long) idle);
+  msg ("%d ticks asleep were idle, %d busy ticks were not.",
+       PACE_TICKS, PACE_TICKS);
+}
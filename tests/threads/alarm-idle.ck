@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(alarm-idle) begin
+(alarm-idle) Sleeping with no other thread to run.
+(alarm-idle) slept 2 ticks: woke up after 2 ticks
+(alarm-idle) slept 5 ticks: woke up after 5 ticks
+(alarm-idle) slept 6 ticks: woke up after 6 ticks
+(alarm-idle) slept 11 ticks: woke up after 11 ticks
+(alarm-idle) slept 64 ticks: woke up after 64 ticks
+(alarm-idle) slept 333 ticks: woke up after 333 ticks
+(alarm-idle) 100 ticks asleep were idle, 100 busy ticks were not.
+(alarm-idle) end
+EOF
+pass;
@@ -0,0 +1,129 @@
+/* Starts threads that all go to sleep on the same tick, for
+   durations that fall into different levels of the sleep wheel and
+   on either side of its slot boundaries, plus one thread whose wake
+   time lies beyond the wheel's horizon of 2**24 ticks.  Verifies
+   that the threads wake up in order, each exactly on its tick, and
+   that the far sleeper does not wake up early. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/init.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "devices/timer.h"
+
+/* Sleep durations, in ticks, in the order the threads wake up. */
+static const int durations[] =
+  {1, 2, 63, 64, 65, 127, 128, 1000, 4095, 4096, 4097, 5000};
+#define SLEEPER_CNT ((int) (sizeof durations / sizeof *durations))
+
+/* Duration of the far sleeper: past the wheel's horizon. */
+#define FAR_DURATION ((1LL << 24) + 65)
+
+/* Information about the test. */
+struct order_test
+  {
+    int64_t start;              /* Tick on which all threads sleep. */
+
+    /* Output. */
+    struct lock output_lock;    /* Lock protecting output. */
+    int order[SLEEPER_CNT + 1]; /* IDs of threads, in wake-up order. */
+    int woke[SLEEPER_CNT + 1];  /* Wake-up tick of each thread,
+                                   relative to START. */
+    int woke_cnt;               /* Number of threads woken up. */
+  };
+
+/* Information about an individual thread in the test. */
+struct order_thread
+  {
+    struct order_test *test;    /* Info shared between all threads. */
+    int id;                     /* Sleeper ID. */
+    int64_t duration;           /* Number of ticks to sleep. */
+  };
+
+static void sleeper (void *);
+
+void
+test_alarm_order (void)
+{
+  struct order_test test;
+  struct order_thread threads[SLEEPER_CNT + 1];
+  int i;
+
+  /* This test does not work with the MLFQS. */
+  ASSERT (!thread_mlfqs);
+
+  msg ("Creating %d threads to sleep from %d to %d ticks,",
+       SLEEPER_CNT, durations[0], durations[SLEEPER_CNT - 1]);
+  msg ("and 1 thread to sleep %lld ticks.", FAR_DURATION);
+  msg ("If successful, each thread will wake up after its");
+  msg ("duration, in order, and the last one will not.");
+
+  /* Start off a level-0 slot boundary, so that the wake times cross
+     the boundaries of every level at a different point than the
+     durations do. */
+  test.start = timer_ticks () + 100;
+  test.start += (37 - test.start % 64 + 64) % 64;
+  lock_init (&test.output_lock);
+  test.woke_cnt = 0;
+
+  /* Start threads.  They run at a higher priority than ours, so
+     that each one runs on the tick it wakes up. */
+  for (i = 0; i <= SLEEPER_CNT; i++)
+    {
+      struct order_thread *t = threads + i;
+      char name[16];
+
+      t->test = &test;
+      t->id = i;
+      t->duration = i < SLEEPER_CNT ? durations[i] : FAR_DURATION;
+
+      snprintf (name, sizeof name, "sleeper %d", i);
+      thread_create (name, PRI_DEFAULT + 1, sleeper, t);
+    }
+
+  /* Wait long enough for all but the far sleeper to finish. */
+  timer_sleep (test.start + durations[SLEEPER_CNT - 1] + 100
+               - timer_ticks ());
+
+  lock_acquire (&test.output_lock);
+  for (i = 0; i < test.woke_cnt; i++)
+    {
+      struct order_thread *t = threads + test.order[i];
+
+      if (t->id == SLEEPER_CNT)
+        fail ("thread %d woke up after %d ticks instead of %lld",
+              t->id, test.woke[t->id], FAR_DURATION);
+      msg ("thread %d: duration=%d, woke up after %d ticks",
+           t->id, (int) t->duration, test.woke[t->id]);
+      if (t->id != i)
+        fail ("thread %d woke up out of order", t->id);
+      if (test.woke[t->id] != t->duration)
+        fail ("thread %d woke up %d ticks late", t->id,
+              test.woke[t->id] - (int) t->duration);
+    }
+  if (test.woke_cnt != SLEEPER_CNT)
+    fail ("%d threads woke up instead of %d", test.woke_cnt, SLEEPER_CNT);
+  msg ("thread %d: still asleep", SLEEPER_CNT);
+  lock_release (&test.output_lock);
+}
+
+/* Sleeper thread. */
+static void
+sleeper (void *t_)
+{
+  struct order_thread *t = t_;
+  struct order_test *test = t->test;
+  int woke;
+
+  /* Make all threads go to sleep on the same tick. */
+  timer_sleep (test->start - timer_ticks ());
+
+  timer_sleep (test->start + t->duration - timer_ticks ());
+  woke = timer_ticks () - test->start;
+
+  lock_acquire (&test->output_lock);
+  test->woke[t->id] = woke;
+  test->order[test->woke_cnt++] = t->id;
+  lock_release (&test->output_lock);
+}
@@ -0,0 +1,26 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(alarm-order) begin
+(alarm-order) Creating 12 threads to sleep from 1 to 5000 ticks,
+(alarm-order) and 1 thread to sleep 16777281 ticks.
+(alarm-order) If successful, each thread will wake up after its
+(alarm-order) duration, in order, and the last one will not.
+(alarm-order) thread 0: duration=1, woke up after 1 ticks
+(alarm-order) thread 1: duration=2, woke up after 2 ticks
+(alarm-order) thread 2: duration=63, woke up after 63 ticks
+(alarm-order) thread 3: duration=64, woke up after 64 ticks
+(alarm-order) thread 4: duration=65, woke up after 65 ticks
+(alarm-order) thread 5: duration=127, woke up after 127 ticks
+(alarm-order) thread 6: duration=128, woke up after 128 ticks
+(alarm-order) thread 7: duration=1000, woke up after 1000 ticks
+(alarm-order) thread 8: duration=4095, woke up after 4095 ticks
+(alarm-order) thread 9: duration=4096, woke up after 4096 ticks
+(alarm-order) thread 10: duration=4097, woke up after 4097 ticks
+(alarm-order) thread 11: duration=5000, woke up after 5000 ticks
+(alarm-order) thread 12: still asleep
+(alarm-order) end
+EOF
+pass;
@@ -23,6 +23,14 @@ test_alarm_multiple (void)
 {
   test_sleep (5, 7);
 }
+
+/* Enough threads and iterations that the sleepers spread over the
+   first two levels of the sleep wheel. */
+void
+test_alarm_scaled (void) 
+{
+  test_sleep (40, 5);
+}
 
 /* Information about the test. */
 struct sleep_test 
@@ -1,5 +1,6 @@
 sub check_alarm {
-    my ($iterations) = @_;
+    my ($iterations, $thread_cnt) = @_;
+    $thread_cnt = 5 if !defined $thread_cnt;
     our ($test);
 
     @output = read_text_file ("$test.output");
@@ -7,7 +8,7 @@ sub check_alarm {
 
     my (@products);
     for (my ($i) = 0; $i < $iterations; $i++) {
-	for (my ($t) = 0; $t < 5; $t++) {
+	for (my ($t) = 0; $t < $thread_cnt; $t++) {
 	    push (@products, ($i + 1) * ($t + 1) * 10);
 	}
     }
@@ -9,6 +9,7 @@
 #include "threads/thread.h"
 #include "threads/mmu.h"
 #include "threads/vaddr.h"
+#include "devices/lapic.h"
 #include "devices/timer.h"
 #include "intrinsic.h"
 #ifdef USERPROG
@@ -103,6 +104,10 @@ static const char *intr_names[INTR_CNT];
 static bool in_external_intr;   /* Are we processing an external interrupt? */
 static bool yield_on_return;    /* Should we yield on interrupt return? */
 
+/* External interrupts that come from the local APIC rather than
+   the PICs, and so are acknowledged there. */
+static bool intr_lapic[INTR_CNT];
+
 /* Programmable Interrupt Controller helpers. */
 static void pic_init (void);
 static void pic_end_of_interrupt (int irq);
@@ -231,6 +236,17 @@ intr_register_ext (uint8_t vec_no, intr_handler_func *handler,
 	register_handler (vec_no, 0, INTR_OFF, handler, name);
 }
 
+/* Registers external interrupt VEC_NO, raised by the local APIC,
+   to invoke HANDLER, which is named NAME for debugging purposes.
+   The handler will execute with interrupts disabled. */
+void
+intr_register_lapic (uint8_t vec_no, intr_handler_func *handler,
+		const char *name) {
+	ASSERT (vec_no >= 0x30);
+	register_handler (vec_no, 0, INTR_OFF, handler, name);
+	intr_lapic[vec_no] = true;
+}
+
 /* Registers internal interrupt VEC_NO to invoke HANDLER, which
    is named NAME for debugging purposes.  The interrupt handler
    will be invoked with interrupt status LEVEL.
@@ -335,9 +351,11 @@ intr_handler (struct intr_frame *frame) {
 
 	/* External interrupts are special.
 	   We only handle one at a time (so interrupts must be off)
-	   and they need to be acknowledged on the PIC (see below).
+	   and they need to be acknowledged on the PIC, or on the
+	   local APIC (see below).
 	   An external interrupt handler cannot sleep. */
-	external = frame->vec_no >= 0x20 && frame->vec_no < 0x30;
+	external = (frame->vec_no >= 0x20 && frame->vec_no < 0x30)
+		|| intr_lapic[frame->vec_no];
 	if (external) {
 		ASSERT (intr_get_level () == INTR_OFF);
 		ASSERT (!intr_context ());
@@ -367,7 +385,10 @@ intr_handler (struct intr_frame *frame) {
 		ASSERT (intr_context ());
 
 		in_external_intr = false;
-		pic_end_of_interrupt (frame->vec_no);
+		if (intr_lapic[frame->vec_no])
+			lapic_eoi ();
+		else
+			pic_end_of_interrupt (frame->vec_no);
 
 		if (yield_on_return)
 			thread_yield ();
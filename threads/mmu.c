@@ -13,6 +13,9 @@ pgdir_walk (uint64_t *pdp, const uint64_t va, int create) {
 	int idx = PDX (va);
 	if (pdp) {
 		uint64_t *pte = (uint64_t *) pdp[idx];
+		/* A 2 MB page has no page table entries to return. */
+		if ((uint64_t) pte & PTE_PS)
+			return NULL;
 		if (!((uint64_t) pte & PTE_P)) {
 			if (create) {
 				uint64_t *new_page = palloc_get_page (PAL_ZERO);
@@ -88,6 +91,38 @@ pml4e_walk (uint64_t *pml4e, const uint64_t va, int create) {
 	return pte;
 }
 
+/* Returns the page directory entry for VA in PML4. If a directory
+ * above it is missing, it is created if CREATE is true; otherwise, or
+ * if memory allocation fails, returns a null pointer. */
+static uint64_t *
+pde_walk (uint64_t *pml4, const uint64_t va, bool create) {
+	const unsigned idx[2] = { PML4 (va), PDPE (va) };
+	uint64_t *table = pml4;
+
+	for (int level = 0; level < 2; level++) {
+		uint64_t *e = &table[idx[level]];
+		if (!(*e & PTE_P)) {
+			uint64_t *new_page;
+			if (!create || (new_page = palloc_get_page (PAL_ZERO)) == NULL)
+				return NULL;
+			*e = vtop (new_page) | PTE_U | PTE_W | PTE_P;
+		}
+		table = ptov (PTE_ADDR (*e));
+	}
+	return &table[PDX (va)];
+}
+
+/* Returns the page directory entry mapping VA in PML4 with a 2 MB
+ * page, or a null pointer if VA is not mapped that way. */
+static uint64_t *
+huge_pde (uint64_t *pml4, const void *va) {
+	uint64_t *pde = pde_walk (pml4, (uint64_t) va, false);
+
+	if (pde != NULL && (*pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		return pde;
+	return NULL;
+}
+
 /* Creates a new page map level 4 (pml4) has mappings for kernel
  * virtual addresses, but none for user virtual addresses.
  * Returns the new page directory, or a null pointer if memory
@@ -122,7 +157,8 @@ pgdir_for_each (uint64_t *pdp, pte_for_each_func *func, void *aux,
 		unsigned pml4_index, unsigned pdp_index) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
-		if (((uint64_t) pte) & PTE_P)
+		/* 2 MB pages have no page table entries to visit. */
+		if ((((uint64_t) pte) & PTE_P) && !(((uint64_t) pte) & PTE_PS))
 			if (!pt_for_each ((uint64_t *) PTE_ADDR (pte), func, aux,
 					pml4_index, pdp_index, i))
 				return false;
@@ -169,6 +205,9 @@ static void
 pgdir_destroy (uint64_t *pdp) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
+		/* The frame table splits 2 MB pages before freeing their
+		 * frames, so none may be left here. */
+		ASSERT ((((uint64_t) pte) & (PTE_P | PTE_PS)) != (PTE_P | PTE_PS));
 		if (((uint64_t) pte) & PTE_P)
 			pt_destroy (PTE_ADDR (pte));
 	}
@@ -214,6 +253,10 @@ void *
 pml4_get_page (uint64_t *pml4, const void *uaddr) {
 	ASSERT (is_user_vaddr (uaddr));
 
+	uint64_t *pde = huge_pde (pml4, uaddr);
+	if (pde != NULL)
+		return ptov (PTE_ADDR (*pde)) + ((uint64_t) uaddr & (HUGE_PGSIZE - 1));
+
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) uaddr, 0);
 
 	if (pte && (*pte & PTE_P))
@@ -252,6 +295,7 @@ pml4_clear_page (uint64_t *pml4, void *upage) {
 	uint64_t *pte;
 	ASSERT (pg_ofs (upage) == 0);
 	ASSERT (is_user_vaddr (upage));
+	ASSERT (huge_pde (pml4, upage) == NULL);
 
 	pte = pml4e_walk (pml4, (uint64_t) upage, false);
 
@@ -268,7 +312,9 @@ pml4_clear_page (uint64_t *pml4, void *upage) {
  * Returns false if PML4 contains no PTE for VPAGE. */
 bool
 pml4_is_dirty (uint64_t *pml4, const void *vpage) {
-	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
+	uint64_t *pte = huge_pde (pml4, vpage);
+	if (pte == NULL)
+		pte = pml4e_walk (pml4, (uint64_t) vpage, false);
 	return pte != NULL && (*pte & PTE_D) != 0;
 }
 
@@ -276,7 +322,9 @@ pml4_is_dirty (uint64_t *pml4, const void *vpage) {
  * in PML4. */
 void
 pml4_set_dirty (uint64_t *pml4, const void *vpage, bool dirty) {
-	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
+	uint64_t *pte = huge_pde (pml4, vpage);
+	if (pte == NULL)
+		pte = pml4e_walk (pml4, (uint64_t) vpage, false);
 	if (pte) {
 		if (dirty)
 			*pte |= PTE_D;
@@ -294,7 +342,9 @@ pml4_set_dirty (uint64_t *pml4, const void *vpage, bool dirty) {
  * PML4 contains no PTE for VPAGE. */
 bool
 pml4_is_accessed (uint64_t *pml4, const void *vpage) {
-	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
+	uint64_t *pte = huge_pde (pml4, vpage);
+	if (pte == NULL)
+		pte = pml4e_walk (pml4, (uint64_t) vpage, false);
 	return pte != NULL && (*pte & PTE_A) != 0;
 }
 
@@ -302,7 +352,9 @@ pml4_is_accessed (uint64_t *pml4, const void *vpage) {
    VPAGE in PD. */
 void
 pml4_set_accessed (uint64_t *pml4, const void *vpage, bool accessed) {
-	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
+	uint64_t *pte = huge_pde (pml4, vpage);
+	if (pte == NULL)
+		pte = pml4e_walk (pml4, (uint64_t) vpage, false);
 	if (pte) {
 		if (accessed)
 			*pte |= PTE_A;
@@ -313,3 +365,55 @@ pml4_set_accessed (uint64_t *pml4, const void *vpage, bool accessed) {
 			invlpg ((uint64_t) vpage);
 	}
 }
+
+/* Maps the 2 MB user virtual page UPAGE in PML4 to the 2 MB of
+ * physical memory at kernel virtual address KPAGE with a single page
+ * directory entry. Both must be 2 MB aligned, and no page in UPAGE
+ * may be mapped. A page table left empty there is freed.
+ * Returns true if successful, false if memory allocation failed or
+ * the range still holds 4 kB mappings. */
+bool
+pml4_set_huge_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
+	ASSERT ((uint64_t) upage % HUGE_PGSIZE == 0);
+	ASSERT ((uint64_t) kpage % HUGE_PGSIZE == 0);
+	ASSERT (is_user_vaddr (upage));
+	ASSERT (pml4 != base_pml4);
+
+	uint64_t *pde = pde_walk (pml4, (uint64_t) upage, true);
+	if (pde == NULL)
+		return false;
+	if (*pde & PTE_P) {
+		uint64_t *pt = ptov (PTE_ADDR (*pde));
+		if (*pde & PTE_PS)
+			return false;
+		for (unsigned i = 0; i < PGSIZE / sizeof (uint64_t); i++)
+			if (pt[i] & PTE_P)
+				return false;
+		palloc_free_page (pt);
+	}
+	*pde = vtop (kpage) | PTE_PS | PTE_P | (rw ? PTE_W : 0) | PTE_U;
+	return true;
+}
+
+/* Replaces the 2 MB mapping of UPAGE in PML4 with 512 4 kB mappings
+ * of the same memory, held in PT, a kernel page to become the page
+ * table. The permission, accessed and dirty bits carry over to every
+ * 4 kB page. */
+void
+pml4_split_huge_page (uint64_t *pml4, void *upage, void *pt_) {
+	uint64_t *pde = huge_pde (pml4, upage);
+	uint64_t *pt = pt_;
+
+	ASSERT (pde != NULL);
+	ASSERT ((uint64_t) upage % HUGE_PGSIZE == 0);
+
+	uint64_t pa = PTE_ADDR (*pde);
+	uint64_t flags = *pde & PTE_FLAGS & ~(uint64_t) PTE_PS;
+	for (unsigned i = 0; i < HUGE_PGCNT; i++)
+		pt[i] = (pa + i * PGSIZE) | flags;
+	*pde = vtop (pt) | PTE_U | PTE_W | PTE_P;
+
+	/* Invalidating any address of the large page drops its entry. */
+	if (rcr3 () == vtop (pml4))
+		invlpg ((uint64_t) upage);
+}
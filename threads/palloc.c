@@ -261,10 +261,30 @@ palloc_init (void) {
    FLAGS, in which case the kernel panics. */
 void *
 palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
+	return palloc_get_multiple_aligned (flags, page_cnt, 1);
+}
+
+/* Like palloc_get_multiple(), but the address of the first page is
+   a multiple of ALIGN pages. */
+void *
+palloc_get_multiple_aligned (enum palloc_flags flags, size_t page_cnt,
+		size_t align) {
 	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	size_t page_idx = BITMAP_ERROR;
 
 	lock_acquire (&pool->lock);
-	size_t page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+	if (align <= 1)
+		page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+	else {
+		/* Try each aligned start in turn. */
+		size_t idx = (align - pg_no (pool->base) % align) % align;
+		for (; idx + page_cnt <= bitmap_size (pool->used_map); idx += align)
+			if (!bitmap_contains (pool->used_map, idx, page_cnt, true)) {
+				bitmap_set_multiple (pool->used_map, idx, page_cnt, true);
+				page_idx = idx;
+				break;
+			}
+	}
 	lock_release (&pool->lock);
 	void *pages;
 
@@ -328,6 +348,14 @@ palloc_free_page (void *page) {
 	palloc_free_multiple (page, 1);
 }
 
+/* Returns the number of pages in the user pool and stores the
+   kernel virtual address of its first page in *BASE. */
+size_t
+palloc_user_pool (void **base) {
+	*base = user_pool.base;
+	return bitmap_size (user_pool.used_map);
+}
+
 /* Initializes pool P as starting at START and ending at END */
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
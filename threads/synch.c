@@ -224,7 +224,7 @@ lock_acquire (struct lock *lock) {
 		for(; depth < 8; depth++){
 			if(curr->want_to_acquire){
 				struct thread *lock_holder = curr->want_to_acquire->holder;
-				lock_holder->priority = curr->priority;
+				thread_change_priority(lock_holder, curr->priority);
 				curr = lock_holder;
 			}
 			else break;
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "threads/flags.h"
+#include "devices/timer.h"
 #include "threads/interrupt.h"
 #include "threads/intr-stubs.h"
 #include "threads/palloc.h"
@@ -39,12 +40,45 @@
 
 int load_avg;
 
-/* List of processes in THREAD_READY state, that is, processes
-   that are ready to run but not actually running. */
-static struct list ready_list;
-
-/* List of processes which are in sleep mode. */
-static struct list sleep_list;
+/* recent_cpu is decayed once a second, but only the running and
+   ready threads are decayed on time.  A blocked thread remembers in
+   rec_cpu_stamp the last second it was decayed for, and catches up
+   from decay_coef[] when it is next looked at.  decay_coef[S %
+   MLFQS_DECAY_HISTORY] holds the coefficient of second S. */
+#define MLFQS_DECAY_HISTORY 256
+static int decay_coef[MLFQS_DECAY_HISTORY];
+static int64_t mlfqs_seconds;
+
+/* Set when ready threads' recent_cpu was decayed and their
+   priorities are not yet recomputed. */
+static bool ready_prio_stale;
+
+/* Processes in THREAD_READY state, that is, processes that are
+   ready to run but not actually running.  There is one FIFO queue
+   per priority, and bit P of ready_mask is set while
+   ready_queues[P] is nonempty, so the highest ready priority is
+   found with a single bit scan. */
+static struct list ready_queues[PRI_MAX + 1];
+static uint64_t ready_mask;
+static size_t ready_cnt;
+
+/* Processes which are in sleep mode, kept in a hierarchical timer
+   wheel keyed on time_awake.  Level L has SLEEP_WHEEL_SIZE slots,
+   each SLEEP_WHEEL_SIZE^L ticks wide.  A thread sleeping for fewer
+   than SLEEP_WHEEL_SIZE ticks sits in level 0, in the slot of its
+   exact wake tick.  A longer sleeper sits in a coarser level and is
+   cascaded down when its slot comes around.  Each tick therefore
+   looks at one level-0 slot, plus one slot per level every
+   SLEEP_WHEEL_SIZE ticks, however many threads are asleep.  Bit S
+   of sleep_mask[L] is set while sleep_wheel[L][S] is nonempty. */
+#define SLEEP_WHEEL_BITS 6
+#define SLEEP_WHEEL_SIZE (1 << SLEEP_WHEEL_BITS)
+#define SLEEP_WHEEL_LEVELS 4
+static struct list sleep_wheel[SLEEP_WHEEL_LEVELS][SLEEP_WHEEL_SIZE];
+static uint64_t sleep_mask[SLEEP_WHEEL_LEVELS];
+
+/* Last tick processed by thread_awake(). */
+static int64_t sleep_clock;
 
 /* Idle thread. */
 static struct thread *idle_thread;
@@ -76,6 +110,12 @@ static void kernel_thread (thread_func *, void *aux);
 
 static void idle (void *aux UNUSED);
 static struct thread *next_thread_to_run (void);
+static void ready_push (struct thread *);
+static struct thread *ready_pop (void);
+static int ready_max_priority (void);
+static void sleep_insert (struct thread *);
+static void sleepers_apply (void (*func) (struct thread *));
+static void mlfqs_catch_up (struct thread *);
 static void init_thread (struct thread *, const char *name, int priority);
 static void do_schedule(int status);
 static void schedule (void);
@@ -125,10 +165,18 @@ thread_init (void) {
 
 	/* Init the globla thread context */
 	lock_init (&tid_lock);
-	list_init (&ready_list);
+	for (int pri = PRI_MIN; pri <= PRI_MAX; pri++)
+		list_init (&ready_queues[pri]);
+	ready_mask = 0;
+	ready_cnt = 0;
 	load_avg = LOAD_AVG_DEFAULT;
 	list_init (&destruction_req);
-	list_init(&sleep_list);
+	for (int level = 0; level < SLEEP_WHEEL_LEVELS; level++) {
+		for (int slot = 0; slot < SLEEP_WHEEL_SIZE; slot++)
+			list_init (&sleep_wheel[level][slot]);
+		sleep_mask[level] = 0;
+	}
+	sleep_clock = 0;
 
 	/* Set up a thread structure for the running thread. */
 	initial_thread = running_thread ();
@@ -175,6 +223,23 @@ thread_tick (void) {
 		intr_yield_on_return ();
 }
 
+/* Charges CNT timer ticks, during which the timer was stopped and
+   the CPU halted, to the idle thread. */
+void
+thread_tick_idle (int64_t cnt) {
+	idle_ticks += cnt;
+}
+
+/* Returns the number of timer ticks spent idle since the OS
+   booted. */
+int64_t
+thread_idle_ticks (void) {
+	enum intr_level old_level = intr_disable ();
+	int64_t cnt = idle_ticks;
+	intr_set_level (old_level);
+	return cnt;
+}
+
 /* Prints thread statistics. */
 void
 thread_print_stats (void) {
@@ -261,6 +326,71 @@ priority_less(const struct list_elem *a_, const struct list_elem *b_, void *aux
 	return a->priority > b->priority;
 }
 
+/* Appends T to the ready queue for its priority. */
+static void
+ready_push (struct thread *t) {
+	ASSERT (intr_get_level () == INTR_OFF);
+	ASSERT (t->priority >= PRI_MIN && t->priority <= PRI_MAX);
+
+	list_push_back (&ready_queues[t->priority], &t->elem);
+	ready_mask |= 1ULL << t->priority;
+	ready_cnt++;
+}
+
+/* Removes ready thread T from its ready queue. */
+static void
+ready_remove (struct thread *t) {
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	list_remove (&t->elem);
+	if (list_empty (&ready_queues[t->priority]))
+		ready_mask &= ~(1ULL << t->priority);
+	ready_cnt--;
+}
+
+/* Returns the highest priority among ready threads, or PRI_MIN - 1
+   if no thread is ready. */
+static int
+ready_max_priority (void) {
+	if (ready_mask == 0)
+		return PRI_MIN - 1;
+	return 63 - __builtin_clzll (ready_mask);
+}
+
+/* Removes and returns the first thread of the highest-priority
+   nonempty ready queue.  There must be a ready thread. */
+static struct thread *
+ready_pop (void) {
+	struct list *queue;
+	struct thread *t;
+
+	ASSERT (ready_mask != 0);
+
+	queue = &ready_queues[ready_max_priority ()];
+	t = list_entry (list_front (queue), struct thread, elem);
+	ready_remove (t);
+	return t;
+}
+
+/* Sets T's priority to PRIORITY.  If T is ready, it is moved to the
+   back of the queue for its new priority, as if it had been
+   unblocked again. */
+void
+thread_change_priority (struct thread *t, int priority) {
+	enum intr_level old_level;
+
+	ASSERT (is_thread (t));
+
+	old_level = intr_disable ();
+	if (t->status == THREAD_READY && t->priority != priority) {
+		ready_remove (t);
+		t->priority = priority;
+		ready_push (t);
+	} else
+		t->priority = priority;
+	intr_set_level (old_level);
+}
+
 /* Puts the current thread to sleep.  It will not be scheduled
    again until awoken by thread_unblock().
 
@@ -291,7 +421,11 @@ thread_unblock (struct thread *t) {
 
 	old_level = intr_disable ();
 	ASSERT (t->status == THREAD_BLOCKED);
-	list_insert_ordered(&ready_list, &t->elem, priority_less, NULL);
+	if (thread_mlfqs && t != idle_thread) {
+		mlfqs_catch_up (t);
+		mlfqs_prio_calc (t);
+	}
+	ready_push (t);
 	t->status = THREAD_READY;
 	intr_set_level (old_level);
 }
@@ -364,8 +498,11 @@ thread_yield (void) {
 	ASSERT (!intr_context ());
 
 	old_level = intr_disable ();
-	if (curr != idle_thread)
-		list_insert_ordered(&ready_list, &curr->elem, priority_less, NULL);
+	if (curr != idle_thread) {
+		if (thread_mlfqs)
+			mlfqs_prio_calc (curr);
+		ready_push (curr);
+	}
 	do_schedule (THREAD_READY);
 	intr_set_level (old_level);
 }
@@ -379,33 +516,163 @@ thread_sleep(int64_t start, int64_t ticks) {
 	ASSERT (!intr_context ());
 
 	old_level = intr_disable ();
-	if (curr != idle_thread)
+	if (curr != idle_thread && start + ticks > sleep_clock)
 	{
-		list_insert_ordered(&sleep_list, &curr->elem, priority_less, NULL);
 		curr->time_awake = start + ticks;
+		sleep_insert(curr);
 		thread_block();
 	}
 	intr_set_level (old_level);
 }
 
+/* Puts sleeping thread T into the slot of the sleep wheel that
+   covers its wake time, relative to sleep_clock.  Wake times beyond
+   the reach of the top level are parked in its farthest slot and
+   re-filed when that slot is cascaded. */
+static void
+sleep_insert (struct thread *t) {
+	int64_t delta = t->time_awake - sleep_clock;
+	int64_t when = t->time_awake;
+	int level, slot;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+	ASSERT (delta > 0);
+
+	for (level = 0; level < SLEEP_WHEEL_LEVELS - 1; level++)
+		if (delta < (1LL << (SLEEP_WHEEL_BITS * (level + 1))))
+			break;
+	if (delta >= (1LL << (SLEEP_WHEEL_BITS * SLEEP_WHEEL_LEVELS)))
+		when = sleep_clock + (1LL << (SLEEP_WHEEL_BITS * SLEEP_WHEEL_LEVELS)) - 1;
+
+	slot = (when >> (SLEEP_WHEEL_BITS * level)) & (SLEEP_WHEEL_SIZE - 1);
+	list_push_back (&sleep_wheel[level][slot], &t->elem);
+	sleep_mask[level] |= 1ULL << slot;
+}
+
+/* Empties slot SLOT of sleep wheel level LEVEL into LIST. */
+static void
+sleep_take_slot (int level, int slot, struct list *list) {
+	struct list *src = &sleep_wheel[level][slot];
+
+	list_init (list);
+	if (!list_empty (src))
+		list_splice (list_end (list), list_begin (src), list_end (src));
+	sleep_mask[level] &= ~(1ULL << slot);
+}
+
+/* Advances the sleep wheel by one tick, to sleep_clock + 1: cascades
+   the coarser slots that come due and wakes the threads in the
+   level-0 slot of the new tick. */
+static void
+sleep_wheel_advance (void) {
+	struct list due;
+	int top;
+
+	sleep_clock++;
+
+	/* Levels whose slot boundary falls on this tick, cascaded from
+	   the top down so that threads can drop more than one level. */
+	for (top = 0; top < SLEEP_WHEEL_LEVELS - 1; top++)
+		if (sleep_clock & ((1LL << (SLEEP_WHEEL_BITS * (top + 1))) - 1))
+			break;
+	for (int level = top; level > 0; level--) {
+		int slot = (sleep_clock >> (SLEEP_WHEEL_BITS * level))
+			& (SLEEP_WHEEL_SIZE - 1);
+		if (!(sleep_mask[level] & (1ULL << slot)))
+			continue;
+		sleep_take_slot (level, slot, &due);
+		while (!list_empty (&due)) {
+			struct thread *t = list_entry (list_pop_front (&due),
+					struct thread, elem);
+			if (t->time_awake <= sleep_clock)
+				thread_unblock (t);
+			else
+				sleep_insert (t);
+		}
+	}
+
+	int slot = sleep_clock & (SLEEP_WHEEL_SIZE - 1);
+	if (sleep_mask[0] & (1ULL << slot)) {
+		sleep_take_slot (0, slot, &due);
+		while (!list_empty (&due)) {
+			struct thread *t = list_entry (list_pop_front (&due),
+					struct thread, elem);
+			ASSERT (t->time_awake <= sleep_clock);
+			thread_unblock (t);
+		}
+	}
+}
+
+/* Returns true if any thread is asleep. */
+static bool
+sleepers_exist (void) {
+	for (int level = 0; level < SLEEP_WHEEL_LEVELS; level++)
+		if (sleep_mask[level] != 0)
+			return true;
+	return false;
+}
+
+/* Returns the earliest tick at which a sleeping thread can need
+   waking, or INT64_MAX if no thread is asleep.  Threads in the
+   coarser levels of the sleep wheel are not looked at one by one:
+   none of them wakes before the next level-1 cascade, so that is
+   used as a bound.  Interrupts must be off. */
+int64_t
+thread_next_awake (void) {
+	int64_t next;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	if (!sleepers_exist ())
+		return INT64_MAX;
+
+	next = (sleep_clock | (SLEEP_WHEEL_SIZE - 1)) + 1;
+	if (sleep_mask[0] != 0) {
+		/* Level-0 slots hold the next SLEEP_WHEEL_SIZE ticks, so
+		   rotate the mask to start at the slot for the next tick. */
+		int base = (sleep_clock + 1) & (SLEEP_WHEEL_SIZE - 1);
+		uint64_t mask = sleep_mask[0];
+		uint64_t rotated = base == 0 ? mask
+			: (mask >> base) | (mask << (SLEEP_WHEEL_SIZE - base));
+		int64_t first = sleep_clock + 1 + __builtin_ctzll (rotated);
+		if (first < next)
+			next = first;
+	}
+	return next;
+}
+
+/* Calls FUNC on every sleeping thread.  FUNC must not wake or
+   re-file the thread. */
+static void
+sleepers_apply (void (*func) (struct thread *)) {
+	for (int level = 0; level < SLEEP_WHEEL_LEVELS; level++) {
+		uint64_t mask = sleep_mask[level];
+		while (mask != 0) {
+			int slot = __builtin_ctzll (mask);
+			struct list *list = &sleep_wheel[level][slot];
+			struct list_elem *e;
+
+			for (e = list_begin (list); e != list_end (list); e = list_next (e))
+				func (list_entry (e, struct thread, elem));
+			mask &= mask - 1;
+		}
+	}
+}
+
 /* Awake threads which has passed an expected time from sleep. */
 void
 thread_awake(int64_t ticks) {
-	struct list_elem *e;
-
-	e = list_begin(&sleep_list);
+	ASSERT (intr_get_level () == INTR_OFF);
 
-	while (e != list_end(&sleep_list))
-	{
-		struct thread *t = list_entry (e, struct thread, elem);
-		if (t->time_awake <= ticks)
-		{
-			e = list_remove(e);
-			thread_unblock(t);
-		}
-		else
-			e = list_next(e);
+	/* With nobody asleep there is nothing to cascade, so the wheel
+	   can jump straight to TICKS. */
+	if (!sleepers_exist ()) {
+		if (sleep_clock < ticks)
+			sleep_clock = ticks;
+		return;
 	}
+	while (sleep_clock < ticks)
+		sleep_wheel_advance ();
 }
 
 /* Sets the current thread's priority to NEW_PRIORITY. */
@@ -413,8 +680,6 @@ void
 thread_set_priority (int new_priority) {
 	/* -------------------- Project 1 -------------------- */
 	struct thread *curr = thread_current();
-	struct list_elem *e;
-	struct thread *t;
 	curr->priority = new_priority;	
 	curr->origin_priority = new_priority;
 
@@ -424,19 +689,14 @@ thread_set_priority (int new_priority) {
 
 	/* consider donors' priority */
 	if(!list_empty(&curr->donors)){
-		e = list_begin(&curr->donors);
 		list_sort(&curr->donors, priority_less, NULL);
 		struct thread *great = list_entry(list_front(&curr->donors), struct thread, donors_elem);
 		curr->priority = curr->origin_priority > great->priority ? curr->origin_priority : great->priority;
 	}
 
-	/* consider ready_list's priority */
-	if(!list_empty(&ready_list)){
-		e = list_begin(&ready_list);
-		t = list_entry(e, struct thread, elem);
-		if(t->priority > curr->priority){
-			thread_yield();
-		}
+	/* consider ready queues' priority */
+	if(ready_max_priority() > curr->priority){
+		thread_yield();
 	}
 	/* -------------------- Project 1 -------------------- */
 }
@@ -451,21 +711,15 @@ thread_get_priority (void) {
 void
 thread_set_nice (int nice) {
 	struct thread *curr = thread_current();
-	struct list_elem *e;
-	struct thread *t;
 	curr->nice = nice;
 	if(curr == idle_thread){
 		return;
 	}
 	mlfqs_prio_calc(curr);
 
-	/* consider ready_list's priority */
-	if(!list_empty(&ready_list)){
-		e = list_begin(&ready_list);
-		t = list_entry(e, struct thread, elem);
-		if(t->priority > curr->priority){
-			thread_yield();
-		}
+	/* consider ready queues' priority */
+	if(ready_max_priority() > curr->priority){
+		thread_yield();
 	}
 }
 
@@ -504,10 +758,15 @@ idle (void *idle_started_ UNUSED) {
 	sema_up (idle_started);
 
 	for (;;) {
-		/* Let someone else run. */
+		/* Let someone else run, after catching up on any timer ticks
+		   that passed while the timer was stopped. */
 		intr_disable ();
+		timer_idle_exit ();
 		thread_block ();
 
+		/* Stop the periodic timer until the next sleeper is due. */
+		timer_idle_enter ();
+
 		/* Re-enable interrupts and wait for the next one.
 
 		   The `sti' instruction disables interrupts until the
@@ -556,6 +815,7 @@ init_thread (struct thread *t, const char *name, int priority) {
 	t->want_to_acquire = NULL;			/* Lock that this thread want_to_acquire */
 	t->nice = NICE_DEFAULT;				/* Set nice value as default 0. */
 	t->recent_cpu = RECENT_CPU_DEFAULT; /* Set recent cpu value as default 0. */
+	t->rec_cpu_stamp = mlfqs_seconds;	/* Decayed up to the current second. */
 	/* -------------------- Project 1 -------------------- */
 
 	/* -------------------- Project 2 -------------------- */
@@ -574,10 +834,14 @@ init_thread (struct thread *t, const char *name, int priority) {
    idle_thread. */
 static struct thread *
 next_thread_to_run (void) {
-	if (list_empty (&ready_list))
+	struct thread *t;
+
+	if (ready_mask == 0)
 		return idle_thread;
-	else
-		return list_entry (list_pop_front (&ready_list), struct thread, elem);
+	t = ready_pop ();
+	if (thread_mlfqs)
+		mlfqs_catch_up (t);
+	return t;
 }
 
 /* Use iretq to launch the thread */
@@ -748,29 +1012,37 @@ allocate_tid (void) {
 /* -------------------- Project 1 -------------------- */
 void
 mlfqs_prio_calc(struct thread *t){
-	t->priority = CONV_TO_INT_NEAR(ADD_INT(DIV_INT(-(t->recent_cpu), 4), (PRI_MAX - (t->nice) * 2)));
-	if(t->priority > 63){
-		t->priority = 63;
+	int priority = CONV_TO_INT_NEAR(ADD_INT(DIV_INT(-(t->recent_cpu), 4), (PRI_MAX - (t->nice) * 2)));
+	if(priority > PRI_MAX){
+		priority = PRI_MAX;
 	}
-	else if(t->priority < 0){
-		t->priority = 0;
+	else if(priority < PRI_MIN){
+		priority = PRI_MIN;
 	}
+	thread_change_priority(t, priority);
 }
 
+/* Recomputes the priorities that can have changed since the last
+   call.  Between decays only the running thread's recent_cpu moves:
+   threads that leave the CPU are recomputed by thread_yield(), and
+   blocked threads by thread_unblock().  So the ready threads are
+   walked only after a decay. */
 void
 mlfqs_prio_calc_all(void){
-	struct list_elem *e;
+	struct list_elem *e, *next;
 	struct thread *t;
-	if(!list_empty(&ready_list)){
-		for(e = list_begin(&ready_list); e != list_end(&ready_list); e = list_next(e)){
-			t = list_entry(e, struct thread, elem);
-			mlfqs_prio_calc(t);
-		}
-	}
-	if(!list_empty(&sleep_list)){
-		for(e = list_begin(&sleep_list); e != list_end(&sleep_list); e = list_next(e)){
-			t = list_entry(e, struct thread, elem);
-			mlfqs_prio_calc(t);
+	if(ready_prio_stale){
+		ready_prio_stale = false;
+		/* A thread may move to another queue while we walk, so fetch
+		   the next element first.  Moving into a queue not yet
+		   visited only recomputes the same priority again. */
+		for(int pri = PRI_MIN; pri <= PRI_MAX; pri++){
+			for(e = list_begin(&ready_queues[pri]); e != list_end(&ready_queues[pri]); e = next){
+				next = list_next(e);
+				t = list_entry(e, struct thread, elem);
+				mlfqs_catch_up(t);
+				mlfqs_prio_calc(t);
+			}
 		}
 	}
 	t = thread_current();
@@ -779,25 +1051,45 @@ mlfqs_prio_calc_all(void){
 	}
 }
 
+/* Applies to T's recent_cpu the decays of the seconds since its
+   rec_cpu_stamp.  Sleeping threads are kept within the history by
+   mlfqs_rec_cpu_calc() and get the exact value.  A thread blocked
+   some other way for longer than MLFQS_DECAY_HISTORY seconds gets
+   only the last MLFQS_DECAY_HISTORY decays, so its recent_cpu is an
+   approximation: the older decays are skipped, and with a high
+   load_avg the result can stay above the exact value. */
+static void
+mlfqs_catch_up(struct thread *t){
+	int64_t second = t->rec_cpu_stamp;
+	if(mlfqs_seconds - second > MLFQS_DECAY_HISTORY){
+		second = mlfqs_seconds - MLFQS_DECAY_HISTORY;
+	}
+	while(second < mlfqs_seconds){
+		second++;
+		t->recent_cpu = ADD_INT(MUL_FP(decay_coef[second % MLFQS_DECAY_HISTORY], t->recent_cpu), t->nice);
+	}
+	t->rec_cpu_stamp = mlfqs_seconds;
+}
+
+/* Decays recent_cpu for a new second.  Only the running thread is
+   decayed here; ready threads catch up when they are next
+   recomputed or scheduled, and blocked threads when woken. */
 void
 mlfqs_rec_cpu_calc(void){
-	struct list_elem *e;
 	struct thread *t;
-	if(!list_empty(&ready_list)){
-		for(e = list_begin(&ready_list); e != list_end(&ready_list); e = list_next(e)){
-			t = list_entry(e, struct thread, elem);
-			t->recent_cpu = ADD_INT(MUL_FP(DIV_FP(MUL_INT(load_avg, 2), ADD_INT(MUL_INT(load_avg, 2), 1)), t->recent_cpu), t->nice);
-		}
-	}
-	if(!list_empty(&sleep_list)){
-		for(e = list_begin(&sleep_list); e != list_end(&sleep_list); e = list_next(e)){
-			t = list_entry(e, struct thread, elem);
-			t->recent_cpu = ADD_INT(MUL_FP(DIV_FP(MUL_INT(load_avg, 2), ADD_INT(MUL_INT(load_avg, 2), 1)), t->recent_cpu), t->nice);
-		}
+
+	/* Bring sleepers up to date before the coefficient they may still
+	   need is overwritten. */
+	if((mlfqs_seconds + 1) % MLFQS_DECAY_HISTORY == 0){
+		sleepers_apply(mlfqs_catch_up);
 	}
+	mlfqs_seconds++;
+	decay_coef[mlfqs_seconds % MLFQS_DECAY_HISTORY] = DIV_FP(MUL_INT(load_avg, 2), ADD_INT(MUL_INT(load_avg, 2), 1));
+	ready_prio_stale = true;
+
 	t = thread_current();
 	if(t != idle_thread){
-		t->recent_cpu = ADD_INT(MUL_FP(DIV_FP(MUL_INT(load_avg, 2), ADD_INT(MUL_INT(load_avg, 2), 1)), t->recent_cpu), t->nice);
+		mlfqs_catch_up(t);
 	}
 }
 
@@ -811,7 +1103,7 @@ mlfqs_rec_cpu_inc_per_sec(void){
 
 void
 mlfqs_load_avg_calc(void){
-	int ready_threads = list_size(&ready_list);
+	int ready_threads = ready_cnt;
 	struct thread *curr = thread_current();
 	if(curr != idle_thread){
 		ready_threads++;
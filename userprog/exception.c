@@ -4,6 +4,7 @@
 #include "userprog/gdt.h"
 #include "threads/interrupt.h"
 #include "threads/thread.h"
+#include "userprog/usercopy.h"
 #include "intrinsic.h"
 
 /* Number of page faults processed. */
@@ -146,6 +147,16 @@ page_fault (struct intr_frame *f) {
 		return;
 #endif
 
+	/* A kernel access to user memory that failed reports the failure
+	 * to its caller. */
+	if (!user && usercopy_fixup (f))
+		return;
+
+#ifdef VM
+	/* A bad user address kills the process quietly. */
+	exit(-1);
+#endif
+
 	/* Count page faults. */
 	page_fault_cnt++;
 
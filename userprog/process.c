@@ -325,6 +325,20 @@ process_exit (void) {
 		sema_up(&child->kill_sema);
 	}
 
+#ifdef VM
+	if(vm_stats_on_exit && curr->pml4 != NULL){
+		struct vm_stats stats;
+		vm_get_stats(curr, &stats);
+		printf("%s: rss %zu, wss %zu, fault rate %u\n", curr->name,
+				stats.rss, stats.wss, stats.fault_rate);
+	}
+	/* Release the frames before the executable: once its file is
+	 * writable again, no other process may map its text pages from
+	 * the text cache. */
+	supplemental_page_table_kill(&curr->spt);
+	supplemental_page_table_init(&curr->spt);
+#endif
+
 	palloc_free_multiple(curr->fdt, FD_LIMIT);
 	file_close(curr->run);
 	sema_up(&curr->wait_sema);
@@ -702,12 +716,9 @@ lazy_load_segment (struct page *page, void *aux) {
 	off_t offset = ((struct file_information *)aux)->ofs;
 	size_t page_read_bytes = ((struct file_information *)aux)->read_bytes;
 	size_t page_zero_bytes = PGSIZE - page_read_bytes;
-	file_seek(file, offset);
 
-	if(file_read(file, page->frame->kva, page_read_bytes) != (int)page_read_bytes){
-		palloc_free_page(page->frame->kva);
+	if(vm_file_read(file, page->frame->kva, page_read_bytes, offset) != (int)page_read_bytes)
 		return false;
-	}
 	memset(page->frame->kva + page_read_bytes, 0, page_zero_bytes);
 	return true;
 }
@@ -740,12 +751,23 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 		size_t page_read_bytes = read_bytes < PGSIZE ? read_bytes : PGSIZE;
 		size_t page_zero_bytes = PGSIZE - page_read_bytes;
 
+		/* Pages wholly of BSS are zero-filled on demand, with 2 MB
+		 * pages where a large BSS covers an aligned region. */
+		if(page_read_bytes == 0){
+			if(!vm_alloc_page(VM_ANON | VM_HUGE, upage, writable))
+				return false;
+			zero_bytes -= page_zero_bytes;
+			upage += PGSIZE;
+			continue;
+		}
+
 		/* TODO: Set up aux to pass information to the lazy_load_segment. */
 		struct file_information *aux = (struct file_information *)malloc(sizeof(struct file_information));
 		aux->file = file;
 		aux->ofs = ofs;
 		aux->read_bytes = page_read_bytes;
-		if(!vm_alloc_page_with_initializer(VM_ANON, upage, writable, lazy_load_segment, aux)){
+		if(!vm_alloc_page_with_initializer(VM_ANON | VM_FILE_REGION, upage,
+					writable, lazy_load_segment, aux)){
 			return false;
 		}
 
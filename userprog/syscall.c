@@ -14,6 +14,7 @@
 #include "lib/string.h"
 #include "vm/file.h"
 #include "filesys/directory.h"
+#include "userprog/usercopy.h"
 
 void syscall_entry (void);
 void syscall_handler (struct intr_frame *);
@@ -58,30 +59,21 @@ bool isdir(int);
 int inumber(int);
 int symlink(const char *, const char *);
 
-void
-is_valid_vaddr(void *addr){
-	struct thread *curr = thread_current();
-
-	#ifdef VM
-	/* For project 3 and later. */
-	if(is_kernel_vaddr(addr)){
+/* Copies the string at user address USTR into a new page, which the
+ * caller frees with palloc_free_page(). Terminates the process if
+ * USTR cannot be read or does not fit in a page. */
+static char *
+copy_in_string (const char *ustr) {
+	char *kstr = palloc_get_page(0);
+	if(kstr == NULL){
 		exit(-1);
 	}
-	struct page *page = spt_find_page(&curr->spt, addr);
-	if(page == NULL){
+	int len = strncpy_from_user(kstr, ustr, PGSIZE);
+	if(len < 0 || len == PGSIZE){
+		palloc_free_page(kstr);
 		exit(-1);
 	}
-	else{
-		return true;
-	}
-	#endif
-
-	if(addr == NULL || !(is_user_vaddr(addr)) || pml4_get_page(curr->pml4, addr) == NULL){
-		exit(-1);
-	}
-	else{
-		return true;
-	}
+	return kstr;
 }
 
 void
@@ -199,16 +191,15 @@ void exit (int status) {
 
 tid_t
 fork (const char *thread_name, struct intr_frame *f) {
-	return process_fork(thread_name, f);
+	char *name = copy_in_string(thread_name);
+	tid_t tid = process_fork(name, f);
+	palloc_free_page(name);
+	return tid;
 }
 
 int
 exec (const char *cmd_line) {
-	struct thread *curr = thread_current();
-	is_valid_vaddr(cmd_line);
-
-	char *cmd_copy = palloc_get_page(PAL_ZERO);
-	strlcpy(cmd_copy, cmd_line, strlen(cmd_line) + 1);
+	char *cmd_copy = copy_in_string(cmd_line);
 
 	if(process_exec(cmd_copy) == -1){
 		return -1;
@@ -223,26 +214,30 @@ wait (pid_t pid) {
 
 bool
 create (const char *file, unsigned initial_size) {
-	is_valid_vaddr(file);
+	char *name = copy_in_string(file);
 	lock_acquire(&file_lock);
-	bool ret = filesys_create(file, initial_size);
+	bool ret = filesys_create(name, initial_size);
 	lock_release(&file_lock);
+	palloc_free_page(name);
 	return ret;
 }
 
 bool
 remove (const char *file) {
-	is_valid_vaddr(file);
-	return filesys_remove(file);
+	char *name = copy_in_string(file);
+	bool ret = filesys_remove(name);
+	palloc_free_page(name);
+	return ret;
 }
 
 int
 open (const char *file) {
-	is_valid_vaddr(file); //terminate with -1 if invalid pointer
+	char *name = copy_in_string(file); //terminate with -1 if invalid pointer
 
 	lock_acquire(&file_lock);
-	struct file *f = filesys_open(file);
+	struct file *f = filesys_open(name);
 	lock_release(&file_lock);
+	palloc_free_page(name);
 
 	if(f == NULL){
 		return -1;
@@ -281,31 +276,30 @@ filesize (int fd) {
 	return file_length(fdt[fd]);
 }
 
+/* File data moves between the file system and user buffers through a
+ * kernel page, a chunk at a time: the file system never faults on user
+ * memory while holding its locks, and a bad buffer fails the copy
+ * instead of the access. */
+
 int
 read (int fd, void *buffer, unsigned length) {
-	is_valid_vaddr(buffer);
-	is_valid_vaddr(buffer + length - 1);
-	int size;
+	int size = 0;
 
-	struct page *page = spt_find_page(&thread_current()->spt, buffer);
 	if((fd < 0) || (fd >= FD_LIMIT) || (fd == STDOUT_FILENO)){
 		return -1;
 	}
 	else if(fd == STDIN_FILENO){ // see device/input.c and intq.c, lock is already taken
-		char byte;
 		unsigned char *buf = buffer;
 		for(size = 0; size < length; size++){
-			byte = input_getc();
-			buf[size] = byte;
-			if(byte == "\0"){
+			char byte = input_getc();
+			if(!copy_out(buf + size, &byte, 1)){
+				exit(-1);
+			}
+			if(byte == '\0'){
 				return size;
 			}
 		}
 	}
-	else if(page->writable == false)
-	{
-		exit(-1);
-	}
 	else{
 		struct thread *curr = thread_current();
 		struct file **fdt = curr->fdt;
@@ -313,34 +307,73 @@ read (int fd, void *buffer, unsigned length) {
 		if(fdt[fd] == NULL){
 			return -1;
 		}
+		uint8_t *chunk = palloc_get_page(0);
+		if(chunk == NULL){
+			return -1;
+		}
+		bool ok = true;
 		lock_acquire(&file_lock);
-		size = file_read(fdt[fd], buffer, length);
+		while(ok && size < length){
+			int want = length - size < PGSIZE ? length - size : PGSIZE;
+			int got = file_read(fdt[fd], chunk, want);
+			ok = copy_out(buffer + size, chunk, got);
+			size += got;
+			if(got < want){
+				break;
+			}
+		}
 		lock_release(&file_lock);
+		palloc_free_page(chunk);
+		if(!ok){
+			exit(-1);
+		}
 	}
 	return size;
 }
 
 int 
 write (int fd, const void *buffer, unsigned length) {
-	is_valid_vaddr(buffer);
-	int size;
+	int size = 0;
 	if((fd < 0) || (fd >= 128) || (fd == STDIN_FILENO)){
 		return -1;
 	}
-	else if(fd == STDOUT_FILENO){ // see lib/kernel/console.c, lock is already taken
-		putbuf(buffer, length);
-		size = length;
+	struct thread *curr = thread_current();
+	struct file **fdt = curr->fdt;
+	if(fd != STDOUT_FILENO && fdt[fd] == NULL){
+		return -1;
 	}
-	else{
-		struct thread *curr = thread_current();
-		struct file **fdt = curr->fdt;
-		if(fdt[fd] == NULL){
-			return -1;
-		}
+
+	char *chunk = palloc_get_page(0);
+	if(chunk == NULL){
+		return -1;
+	}
+	bool ok = true;
+	if(fd != STDOUT_FILENO){
 		lock_acquire(&file_lock);
-		size = file_write(fdt[fd], buffer, length);
+	}
+	while(size < length){
+		int want = length - size < PGSIZE ? length - size : PGSIZE;
+		if(!(ok = copy_in(chunk, buffer + size, want))){
+			break;
+		}
+		if(fd == STDOUT_FILENO){ // see lib/kernel/console.c, lock is already taken
+			putbuf(chunk, want);
+			size += want;
+			continue;
+		}
+		int put = file_write(fdt[fd], chunk, want);
+		size += put;
+		if(put < want){
+			break;
+		}
+	}
+	if(fd != STDOUT_FILENO){
 		lock_release(&file_lock);
 	}
+	palloc_free_page(chunk);
+	if(!ok){
+		exit(-1);
+	}
 	return size;
 }
 
@@ -400,12 +433,6 @@ void
 		return NULL;
 	if (length == 0)
 		return NULL;
-	for (uint64_t i = 0; i < length; i += PGSIZE)
-	{
-		void *upage = (void *)((uint64_t)addr + i);
-		if (spt_find_page(&curr->spt, upage) != NULL)
-			return NULL;
-	}
 	if (fd == STDIN_FILENO || fd == STDOUT_FILENO)
 		return NULL;
 	if (file == NULL)
@@ -421,15 +448,19 @@ munmap(void *addr) {
 
 bool 
 chdir(const char *dir){
-	return filesys_chdir(dir);
+	char *name = copy_in_string(dir);
+	bool ret = filesys_chdir(name);
+	palloc_free_page(name);
+	return ret;
 }
 
 bool
 mkdir(const char *dir){
-	is_valid_vaddr(dir);
+	char *name = copy_in_string(dir);
 	lock_acquire(&file_lock);
-	bool ret = filesys_mkdir(dir);
+	bool ret = filesys_mkdir(name);
 	lock_release(&file_lock);
+	palloc_free_page(name);
 	return ret;
 }
 
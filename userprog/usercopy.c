@@ -0,0 +1,118 @@
+/* usercopy.c: Access to user memory from the kernel.
+ *
+ * The copies touch user memory directly instead of checking it first.
+ * A page fault on a user address is handled as usual, loading the page
+ * if it exists. If it does not, or the access is not allowed, the page
+ * fault handler looks the faulting instruction up in the exception
+ * table and resumes at its fixup, from where the copy reports failure.
+ *
+ * Each entry of the table, in section __ex_table, is a pair of
+ * addresses: an instruction that may fault on user memory, and its
+ * fixup. The linker script gathers the entries between
+ * __start_ex_table and __stop_ex_table. */
+
+#include "userprog/usercopy.h"
+#include <stdint.h>
+#include "threads/interrupt.h"
+#include "threads/vaddr.h"
+
+/* An exception table entry. */
+struct exception_entry {
+	uintptr_t insn;        /* Instruction that may fault. */
+	uintptr_t fixup;       /* Where to resume if it does. */
+};
+
+extern const struct exception_entry __start_ex_table[];
+extern const struct exception_entry __stop_ex_table[];
+
+/* Assembler text adding an exception table entry for the instruction
+ * at label INSN, resuming at label FIXUP. */
+#define EX_TABLE_ENTRY(INSN, FIXUP) \
+	".pushsection __ex_table, \"a\"\n\t" \
+	".balign 8\n\t" \
+	".quad " #INSN ", " #FIXUP "\n\t" \
+	".popsection\n\t"
+
+/* Returns true if the SIZE bytes at UADDR lie in user space. A range
+ * reaching into the kernel would not fault, so it is refused up
+ * front. */
+static bool
+is_user_range (const void *uaddr, size_t size) {
+	uintptr_t start = (uintptr_t) uaddr;
+
+	return size == 0
+		|| (start + size > start && is_user_vaddr ((void *) (start + size - 1)));
+}
+
+/* Copies SIZE bytes from SRC to DST, either of which may be in user
+ * space. Returns the number of bytes left uncopied when a bad user
+ * address stopped the copy, or 0. */
+static size_t
+copy_bytes (void *dst, const void *src, size_t size) {
+	asm volatile ("1: rep movsb\n"
+			"2:\n\t"
+			EX_TABLE_ENTRY (1b, 2b)
+			: "+D" (dst), "+S" (src), "+c" (size) : : "memory");
+	return size;
+}
+
+/* Copies SIZE bytes from user address USRC to DST. Returns false if
+ * any of them could not be read. */
+bool
+copy_in (void *dst, const void *usrc, size_t size) {
+	return is_user_range (usrc, size) && copy_bytes (dst, usrc, size) == 0;
+}
+
+/* Copies SIZE bytes from SRC to user address UDST. Returns false if
+ * any of them could not be written. */
+bool
+copy_out (void *udst, const void *src, size_t size) {
+	return is_user_range (udst, size) && copy_bytes (udst, src, size) == 0;
+}
+
+/* Reads the byte at user address UADDR into *BYTE. Returns false if it
+ * could not be read. */
+static bool
+get_user (uint8_t *byte, const uint8_t *uaddr) {
+	int ok = 0;
+
+	if (!is_user_vaddr (uaddr))
+		return false;
+	asm volatile ("1: movb (%2), %1\n\t"
+			"movl $1, %0\n"
+			"2:\n\t"
+			EX_TABLE_ENTRY (1b, 2b)
+			: "+r" (ok), "=&q" (*byte) : "r" (uaddr) : "memory");
+	return ok;
+}
+
+/* Copies the null-terminated string at user address USRC into DST,
+ * which has room for SIZE bytes. Returns the length of the string, or
+ * SIZE if it does not fit, in which case DST is not terminated.
+ * Returns -1 if the string could not be read. */
+int
+strncpy_from_user (char *dst, const char *usrc, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		uint8_t byte;
+		if (!get_user (&byte, (const uint8_t *) usrc + i))
+			return -1;
+		dst[i] = byte;
+		if (byte == '\0')
+			return i;
+	}
+	return size;
+}
+
+/* If F is a page fault in one of the accesses above, arranges for it
+ * to resume at the access's fixup and returns true. */
+bool
+usercopy_fixup (struct intr_frame *f) {
+	const struct exception_entry *e;
+
+	for (e = __start_ex_table; e < __stop_ex_table; e++)
+		if (e->insn == f->rip) {
+			f->rip = e->fixup;
+			return true;
+		}
+	return false;
+}
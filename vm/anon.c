@@ -2,6 +2,14 @@
 
 #include "vm/vm.h"
 #include "devices/disk.h"
+#include <bitmap.h>
+#include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Number of swap disk sectors that hold one page. */
+#define SECTORS_PER_SLOT (PGSIZE / DISK_SECTOR_SIZE)
 
 /* DO NOT MODIFY BELOW LINE */
 static struct disk *swap_disk;
@@ -17,40 +25,141 @@ static const struct page_operations anon_ops = {
 	.type = VM_ANON,
 };
 
+/* In-use swap slots, one bit per page-sized slot of the swap disk. */
+static struct bitmap *swap_table;
+static struct lock swap_lock;
+
+/* Number of pages holding each in-use slot. A slot written out for
+ * a frame shared after fork belongs to all of its pages. */
+static unsigned *slot_refs;
+
 /* Initialize the data for anonymous pages */
 void
 vm_anon_init (void) {
 	/* TODO: Set up the swap_disk. */
-	swap_disk = NULL;
+	swap_disk = disk_get (1, 1);
+	lock_init (&swap_lock);
+	size_t slot_cnt = swap_disk != NULL
+		? disk_size (swap_disk) / SECTORS_PER_SLOT : 0;
+	swap_table = bitmap_create (slot_cnt);
+	slot_refs = calloc (slot_cnt, sizeof *slot_refs);
+	if (swap_table == NULL || (slot_cnt > 0 && slot_refs == NULL))
+		PANIC ("swap table creation failed");
 }
 
 /* Initialize the file mapping */
 bool
 anon_initializer (struct page *page, enum vm_type type, void *kva) {
 	/* Set up the handler */
-	//struct uninit_page *uninit = &page->uninit;
-	//memset(uninit, 0, sizeof(struct uninit_page));
 	page->operations = &anon_ops;
 	struct anon_page *anon_page = &page->anon;
 
-	
+	anon_page->slot = SWAP_SLOT_NONE;
 	return true;
 }
 
+/* Drops one reference to swap slot SLOT, freeing it with the last. */
+static void
+swap_slot_free (size_t slot) {
+	lock_acquire (&swap_lock);
+	ASSERT (bitmap_test (swap_table, slot) && slot_refs[slot] > 0);
+	if (--slot_refs[slot] == 0)
+		bitmap_reset (swap_table, slot);
+	lock_release (&swap_lock);
+}
+
+/* Drops the swap slot references of the swapped-out anonymous pages
+ * among the CNT entries of PAGES, which may include null pointers and
+ * pages of other types, under a single acquisition of the swap
+ * lock. */
+void
+anon_release_slots (struct page **pages, size_t cnt) {
+	lock_acquire (&swap_lock);
+	for (size_t i = 0; i < cnt; i++) {
+		struct page *page = pages[i];
+		if (page == NULL || page->operations != &anon_ops
+				|| page->anon.slot == SWAP_SLOT_NONE)
+			continue;
+
+		size_t slot = page->anon.slot;
+		ASSERT (bitmap_test (swap_table, slot) && slot_refs[slot] > 0);
+		if (--slot_refs[slot] == 0)
+			bitmap_reset (swap_table, slot);
+		page->anon.slot = SWAP_SLOT_NONE;
+	}
+	lock_release (&swap_lock);
+}
+
+/* Makes DST share the swap slot of swapped-out page SRC. */
+void
+anon_share_slot (struct page *dst, struct page *src) {
+	size_t slot = src->anon.slot;
+
+	ASSERT (slot != SWAP_SLOT_NONE);
+	lock_acquire (&swap_lock);
+	slot_refs[slot]++;
+	lock_release (&swap_lock);
+	dst->anon.slot = slot;
+}
+
 /* Swap in the page by read contents from the swap disk. */
 static bool
 anon_swap_in (struct page *page, void *kva) {
 	struct anon_page *anon_page = &page->anon;
+
+	if (anon_page->slot != SWAP_SLOT_NONE) {
+		disk_read_multi (swap_disk, anon_page->slot * SECTORS_PER_SLOT, kva,
+				SECTORS_PER_SLOT);
+		swap_slot_free (anon_page->slot);
+		anon_page->slot = SWAP_SLOT_NONE;
+	}
+	return true;
 }
 
-/* Swap out the page by writing contents to the swap disk. */
+/* Swap out the page by writing contents to the swap disk. A frame
+ * shared copy-on-write is written once, and every page mapping it
+ * takes a reference to the slot. */
 static bool
 anon_swap_out (struct page *page) {
-	struct anon_page *anon_page = &page->anon;
+	struct frame *frame = page->frame;
+	struct list_elem *e;
+
+	lock_acquire (&swap_lock);
+	size_t slot = bitmap_scan_and_flip (swap_table, 0, 1, false);
+	if (slot != BITMAP_ERROR)
+		slot_refs[slot] = frame->ref_cnt;
+	lock_release (&swap_lock);
+	if (slot == BITMAP_ERROR)
+		return false;
+
+	/* Unmap first, so that the owners fault instead of changing the
+	 * page while it is written out. */
+	for (e = list_begin (&frame->pages); e != list_end (&frame->pages);
+			e = list_next (e)) {
+		struct page *p = list_entry (e, struct page, frame_elem);
+		pml4_clear_page (p->owner->pml4, p->va);
+	}
+	disk_write_multi (swap_disk, slot * SECTORS_PER_SLOT, frame->kva,
+			SECTORS_PER_SLOT);
+	for (e = list_begin (&frame->pages); e != list_end (&frame->pages);
+			e = list_next (e)) {
+		struct page *p = list_entry (e, struct page, frame_elem);
+		p->anon.slot = slot;
+		p->frame = NULL;
+	}
+	return true;
 }
 
 /* Destroy the anonymous page. PAGE will be freed by the caller. */
 static void
 anon_destroy (struct page *page) {
 	struct anon_page *anon_page = &page->anon;
+
+	/* Release the frame first: an eviction in progress may still be
+	 * assigning a swap slot. */
+	vm_free_frame (page);
+	if (anon_page->slot != SWAP_SLOT_NONE) {
+		swap_slot_free (anon_page->slot);
+		anon_page->slot = SWAP_SLOT_NONE;
+	}
 }
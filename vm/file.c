@@ -3,15 +3,19 @@
 #include "vm/vm.h"
 #include "threads/vaddr.h"
 #include "threads/mmu.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
 
 static bool file_backed_swap_in (struct page *page, void *kva);
 static bool file_backed_swap_out (struct page *page);
 static void file_backed_destroy (struct page *page);
 
 /* Project 3 */
-static struct list mmap_list;
 static bool lazy_load_file (struct page *page, void *aux);
 
+/* Most pages written back to a file together. */
+#define WRITEBACK_CLUSTER 8
+
 /* DO NOT MODIFY this struct */
 static const struct page_operations file_ops = {
 	.swap_in = file_backed_swap_in,
@@ -23,7 +27,6 @@ static const struct page_operations file_ops = {
 /* The initializer of file vm */
 void
 vm_file_init (void) {
-	list_init(&mmap_list);
 }
 
 /* Initialize the file backed page */
@@ -42,106 +45,321 @@ file_backed_initializer (struct page *page, enum vm_type type, void *kva) {
 static bool
 file_backed_swap_in (struct page *page, void *kva) {
 	struct file_page *file_page UNUSED = &page->file;
-	file_seek(file_page->file, file_page->ofs);
-	off_t read_bytes = file_read(file_page->file, kva, file_page->size); 
+	off_t read_bytes = file_read_at(file_page->file, kva, file_page->size,
+			file_page->ofs);
 	memset(kva+read_bytes, 0, PGSIZE-read_bytes);
 
 	return true;
 }
 
-/* Swap out the page by writeback contents to the file. */
+/* Swap out the page by writeback contents to the file. A clean page is
+ * simply dropped, to be read from the file again on the next fault.
+ * If the writeback fails, the page stays resident and mapped. */
 static bool
 file_backed_swap_out (struct page *page) {
-	struct file_page *file_page UNUSED = &page->file;
-	struct thread *curr = thread_current();
+	struct frame *frame = page->frame;
+	struct list_elem *e;
 
-	if (pml4_is_dirty(curr->pml4, page->va))
-	{
-		file_seek(file_page->file, file_page->ofs);
-		file_write(file_page->file, page->va, file_page->size);
-		pml4_set_dirty(curr->pml4, page->va, false);
+	/* Unmap first, so that the owners fault instead of changing the
+	 * page while it is written out. The dirty bits stay. */
+	for (e = list_begin (&frame->pages); e != list_end (&frame->pages);
+			e = list_next (e)) {
+		struct page *p = list_entry (e, struct page, frame_elem);
+		pml4_clear_page (p->owner->pml4, p->va);
 	}
-
-	pml4_clear_page(curr->pml4, page->va);
-	page->frame = NULL;
-
+	if (!file_backed_writeback (page)) {
+		for (e = list_begin (&frame->pages); e != list_end (&frame->pages);
+				e = list_next (e)) {
+			struct page *p = list_entry (e, struct page, frame_elem);
+			pml4_set_page (p->owner->pml4, p->va, frame->kva, p->writable);
+			pml4_set_dirty (p->owner->pml4, p->va, true);
+		}
+		return false;
+	}
+	for (e = list_begin (&frame->pages); e != list_end (&frame->pages);
+			e = list_next (e))
+		list_entry (e, struct page, frame_elem)->frame = NULL;
 	return true;
 }
 
 /* Destory the file backed page. PAGE will be freed by the caller. */
 static void
 file_backed_destroy (struct page *page) {
-	struct file_page *file_page UNUSED = &page->file;
-	struct thread *curr = thread_current();
+	/* Freeing the frame writes it back. The file belongs to the
+	 * mapping. */
+	vm_free_frame(page);
+}
+
+/* Returns true if PAGE is a resident file page whose contents are
+ * newer than its file, and that can be written back along with a
+ * neighbour. */
+static bool
+writeback_candidate (struct page *page) {
+	return page != NULL && page->operations->type == VM_FILE
+		&& page->frame != NULL && !page->frame->huge && !page->frame->pinned
+		&& !page->frame->writeback
+		&& pml4_is_dirty (page->owner->pml4, page->va);
+}
+
+/* Returns true if file page B holds the part of the file right after
+ * file page A. */
+static bool
+file_page_follows (struct page *a, struct page *b) {
+	return a->file.file == b->file.file && a->file.size == PGSIZE
+		&& b->file.ofs == a->file.ofs + PGSIZE;
+}
+
+/* Writes resident file page PAGE back to its file if it was modified,
+ * together with the modified pages around it that map the same run of
+ * the file, up to WRITEBACK_CLUSTER pages in one write. The frame
+ * table lock must be held. It is released during the write, with the
+ * frames marked WRITEBACK. The dirty bits are cleared, and set again
+ * on the pages that the write did not reach. Returns false if the
+ * write fell short. */
+bool
+file_backed_writeback (struct page *page) {
+	struct supplemental_page_table *spt = &page->owner->spt;
+	uint64_t *pml4 = page->owner->pml4;
+	struct page *run[WRITEBACK_CLUSTER];
+
+	ASSERT (page->frame != NULL && !page->frame->writeback);
+	if (pml4 == NULL || !pml4_is_dirty (pml4, page->va))
+		return true;
 
-	if (pml4_is_dirty(curr->pml4, page->va))
-	{
-		file_seek(file_page->file, file_page->ofs);
-		file_write(file_page->file, page->va, file_page->size);
+	/* Extend the run up to half a cluster back from PAGE, then forward
+	 * to fill the cluster. */
+	struct page *first = page, *last = page;
+	size_t cnt = 1;
+	while (cnt <= WRITEBACK_CLUSTER / 2) {
+		struct page *prev = spt_find_page (spt, (uint8_t *) first->va - PGSIZE);
+		if (!writeback_candidate (prev) || !file_page_follows (prev, first))
+			break;
+		first = prev;
+		cnt++;
 	}
-	file_close(file_page->file);
-	if (page->frame != NULL)
-	{
-		list_remove(&page->frame->frame_elem);
-		list_remove(&page->elem);
-		free(page->frame);
+	while (cnt < WRITEBACK_CLUSTER) {
+		struct page *next = spt_find_page (spt, (uint8_t *) last->va + PGSIZE);
+		if (!writeback_candidate (next) || !file_page_follows (last, next))
+			break;
+		last = next;
+		cnt++;
 	}
+
+	/* A cluster is staged in a buffer of its own. Without one, PAGE is
+	 * written alone, straight from its frame. */
+	uint8_t *buf = cnt > 1 ? palloc_get_multiple (0, cnt) : NULL;
+	if (buf == NULL) {
+		first = last = page;
+		cnt = 1;
+	}
+
+	/* Clear the dirty bits before copying, so that a write from here
+	 * on marks the page dirty again. */
+	for (size_t i = 0; i < cnt; i++) {
+		struct page *p = spt_find_page (spt, (uint8_t *) first->va + i * PGSIZE);
+		p->frame->writeback = true;
+		pml4_set_dirty (pml4, p->va, false);
+		if (buf != NULL)
+			memcpy (buf + i * PGSIZE, p->frame->kva, PGSIZE);
+		run[i] = p;
+	}
+	off_t size = (cnt - 1) * PGSIZE + last->file.size;
+	vm_writeback_begin ();
+	off_t written = file_write_at (first->file.file,
+			buf != NULL ? buf : page->frame->kva, size, first->file.ofs);
+	vm_writeback_end ();
+	palloc_free_multiple (buf, cnt);
+
+	for (size_t i = 0; i < cnt; i++) {
+		run[i]->frame->writeback = false;
+		if (written < (off_t) (i * PGSIZE) + run[i]->file.size)
+			pml4_set_dirty (pml4, run[i]->va, true);
+	}
+	return written == size;
+}
+
+/* Returns the index of the first mapping of SPT that ends after VA,
+ * or the number of mappings if there is none. */
+static size_t
+vma_search (struct supplemental_page_table *spt, void *va) {
+	size_t lo = 0, hi = spt->vma_cnt;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (spt->vmas[mid]->end <= va)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Returns the mapping of SPT that contains VA, or a null pointer. */
+struct vma *
+vma_find (struct supplemental_page_table *spt, void *va) {
+	size_t i = vma_search (spt, va);
+
+	if (i < spt->vma_cnt && spt->vmas[i]->start <= va)
+		return spt->vmas[i];
+	return NULL;
+}
+
+/* Inserts VMA into SPT, keeping the mappings sorted. Returns false
+ * if memory allocation fails. */
+static bool
+vma_insert (struct supplemental_page_table *spt, struct vma *vma) {
+	if (spt->vma_cnt == spt->vma_cap) {
+		size_t cap = spt->vma_cap ? spt->vma_cap * 2 : 4;
+		struct vma **vmas = realloc (spt->vmas, cap * sizeof *vmas);
+		if (vmas == NULL)
+			return false;
+		spt->vmas = vmas;
+		spt->vma_cap = cap;
+	}
+
+	size_t i = vma_search (spt, vma->start);
+	memmove (spt->vmas + i + 1, spt->vmas + i,
+			(spt->vma_cnt - i) * sizeof *spt->vmas);
+	spt->vmas[i] = vma;
+	spt->vma_cnt++;
+	return true;
+}
+
+/* Removes the mapping at index I of SPT. */
+static void
+vma_remove (struct supplemental_page_table *spt, size_t i) {
+	spt->vma_cnt--;
+	memmove (spt->vmas + i, spt->vmas + i + 1,
+			(spt->vma_cnt - i) * sizeof *spt->vmas);
+}
+
+/* Adds the pages of VMA from VA on to the spt of the current thread
+ * that are not there yet, up to CNT pages or the end of the mapping.
+ * For a mapping asking for 2 MB pages, adds the whole aligned 2 MB
+ * region around VA when the mapping covers it. Returns true if the
+ * page at VA exists afterwards. */
+bool
+vma_materialize (struct vma *vma, void *va, size_t cnt) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	uint8_t *upage = pg_round_down (va);
+	enum vm_type type = VM_FILE | VM_FILE_REGION;
+
+	if (vma->huge) {
+		/* vm_claim_huge() needs the whole aligned 2 MB region. */
+		uint8_t *base = (uint8_t *) ((uint64_t) upage & ~(HUGE_PGSIZE - 1));
+		if ((void *) base >= vma->start && (void *) (base + HUGE_PGSIZE) <= vma->end) {
+			upage = base;
+			cnt = HUGE_PGCNT;
+			type |= VM_HUGE;
+		}
+	}
+
+	for (size_t i = 0; i < cnt && (void *) upage < vma->end;
+			i++, upage += PGSIZE) {
+		if (spt_find_page (spt, upage) != NULL)
+			continue;
+
+		size_t pos = upage - (uint8_t *) vma->start;
+		struct file_information *inf = malloc (sizeof *inf);
+		if (inf == NULL)
+			break;
+		inf->file = vma->file;
+		inf->ofs = vma->ofs + pos;
+		inf->read_bytes = vma->length - pos < PGSIZE ? vma->length - pos : PGSIZE;
+		if (!vm_alloc_page_with_initializer (type, upage, vma->writable,
+					lazy_load_file, inf)) {
+			free (inf);
+			break;
+		}
+	}
+	return spt_find_page (spt, va) != NULL;
+}
+
+/* Gives DST a copy of every mapping of SRC, each with the file
+ * reopened. */
+bool
+vma_copy (struct supplemental_page_table *dst,
+		struct supplemental_page_table *src) {
+	for (size_t i = 0; i < src->vma_cnt; i++) {
+		struct vma *vma = malloc (sizeof *vma);
+		if (vma == NULL)
+			return false;
+		*vma = *src->vmas[i];
+		vma->file = file_reopen (vma->file);
+		if (vma->file == NULL || !vma_insert (dst, vma)) {
+			file_close (vma->file);
+			free (vma);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Releases every mapping of SPT. Their pages must already be gone. */
+void
+vma_destroy_all (struct supplemental_page_table *spt) {
+	for (size_t i = 0; i < spt->vma_cnt; i++) {
+		file_close (spt->vmas[i]->file);
+		free (spt->vmas[i]);
+	}
+	free (spt->vmas);
+	spt->vmas = NULL;
+	spt->vma_cnt = spt->vma_cap = 0;
 }
 
 /* Do the mmap */
+/* Records the mapping only; its pages are created on first touch.
+ * Fails if the range overlaps a page or mapping already there. */
 void *
 do_mmap (void *addr, size_t length, int writable,
 		struct file *file, off_t offset) {
-	off_t ofs;
-	uint64_t read_bytes;
-
-	for (uint64_t i = 0; i < length; i += PGSIZE)
-	{
-		struct file_information *inf = malloc(sizeof(struct file_information));
-		ofs = offset + i;
-		
-		if (length - i > PGSIZE)
-			read_bytes = PGSIZE;
-		else
-			read_bytes = length - i;
-		inf->file = file_reopen(file);
-		inf->ofs = ofs;
-		inf->read_bytes = read_bytes;
-		void *upage = (void *)((uint64_t)addr + i);
-		vm_alloc_page_with_initializer(VM_FILE, upage, writable, lazy_load_file, (void *)inf);
-	}
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	void *end = pg_round_up ((uint8_t *) addr + length);
+	struct page *page = spt_next_page (spt, addr);
+	size_t i = vma_search (spt, addr);
 
-	struct mmap_information *minf = malloc(sizeof(struct mmap_information));
-	minf->begin = (uint64_t)addr;
-	minf->end = (uint64_t)pg_round_down((uint64_t)addr+length-1);
-	list_push_back(&mmap_list, &minf->elem);
+	if ((page != NULL && page->va < end)
+			|| (i < spt->vma_cnt && spt->vmas[i]->start < end))
+		return NULL;
 
+	struct vma *vma = malloc (sizeof *vma);
+	if (vma == NULL)
+		return NULL;
+	vma->start = addr;
+	vma->end = end;
+	vma->file = file_reopen (file);
+	vma->ofs = offset;
+	vma->length = length;
+	vma->writable = (writable & ~MMAP_HUGE) != 0;
+	vma->huge = (writable & MMAP_HUGE) != 0;
+	if (vma->file == NULL || !vma_insert (spt, vma)) {
+		file_close (vma->file);
+		free (vma);
+		return NULL;
+	}
 	return addr;
 }
 
 /* Do the munmap */
 void
 do_munmap (void *addr) {
-	struct list_elem *e;
-	e = list_begin(&mmap_list);
-
-	while (e != list_end(&mmap_list))
-	{
-		struct mmap_information *minf = list_entry(e, struct mmap_information, elem);
-		if (minf->begin == (uint64_t)addr)
-		{	
-			for (uint64_t i = (uint64_t)addr; i <= minf->end; i += PGSIZE)
-			{
-				struct thread *curr = thread_current();
-				struct page *page = spt_find_page(&curr->spt, (void *)i);
-				spt_remove_page(&curr->spt, page);
-				pml4_clear_page(curr->pml4, (void *)i);
-			}
-			e = list_remove(e);
-		}
-		else
-			e = list_next(e);
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	size_t i = vma_search (spt, addr);
+
+	if (i == spt->vma_cnt || spt->vmas[i]->start != addr)
+		return;
+
+	/* Destroying a touched page writes it back. */
+	struct vma *vma = spt->vmas[i];
+	struct page *page = spt_next_page (spt, vma->start);
+	while (page != NULL && page->va < vma->end) {
+		struct page *next = spt_next_page (spt, page->va + PGSIZE);
+		spt_remove_page (spt, page);
+		page = next;
 	}
+	vma_remove (spt, i);
+	file_close (vma->file);
+	free (vma);
 }
 
 /* Project 3 */
@@ -149,13 +367,15 @@ static bool
 lazy_load_file (struct page *page, void *aux) {
 	struct file_information *inf = (struct file_information *)aux;
 
-	file_seek(inf->file, inf->ofs);
-	page->file.size = file_read(inf->file, page->va, inf->read_bytes);
+	/* Filled through the kernel mapping: the user mapping may be
+	 * read-only. */
+	page->file.size = vm_file_read(inf->file, page->frame->kva, inf->read_bytes,
+			inf->ofs);
 	page->file.ofs = inf->ofs;
 
 	if (page->file.size != PGSIZE)
-		memset(page->va + page->file.size, 0, PGSIZE - page->file.size);
-	pml4_set_dirty(thread_current()->pml4, page->va, false);
+		memset(page->frame->kva + page->file.size, 0, PGSIZE - page->file.size);
+	pml4_set_dirty(page->owner->pml4, page->va, false);
 	free(inf);
 
 	return true;
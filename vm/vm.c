@@ -3,12 +3,68 @@
 #include "threads/malloc.h"
 #include "vm/vm.h"
 #include "vm/inspect.h"
-#include "lib/kernel/hash.h"
 #include "threads/vaddr.h"
 #include "threads/mmu.h"
+#include "threads/pte.h"
+#include "devices/timer.h"
+#include "filesys/inode.h"
 #include <string.h>
 
-struct list frame_list;
+/* The frame table: one entry per page of the user pool, so that the
+ * frame holding a kernel virtual address is found by indexing. An
+ * entry is in use while some page maps it. */
+static struct frame *frame_table;
+static size_t frame_cnt;
+static uint8_t *frame_base;
+
+/* Next frame the clock algorithm examines. */
+static size_t clock_hand;
+
+/* Period of the working-set scan. Each scan shifts the age of every
+ * frame right, setting AGE_REFERENCED if the frame was accessed, so a
+ * frame is in its processes' working sets while its age is nonzero:
+ * for 8 scans after its last reference. */
+#define WS_SCAN_TICKS (TIMER_FREQ / 4)
+#define AGE_REFERENCED 0x80
+
+/* Frames a bulk pass, such as the working-set scan, handles between
+ * chances for faults to take the frame lock. */
+#define FRAME_LOCK_BATCH 64
+
+static void vm_wsscand (void *aux);
+
+/* Bounds of the fault-around window, in pages. */
+#define FAULT_AROUND_MIN 4
+#define FAULT_AROUND_MAX 16
+
+/* Protects the frame table and serializes eviction. */
+static struct lock frame_lock;
+
+/* Signaled, with frame_lock, when frames finish their writeback. */
+static struct condition writeback_done;
+
+/* Frames of the frame table that some page maps. FRAMES_USED is
+ * signaled, with frame_lock, when the first one comes into use. */
+static size_t frames_in_use;
+static struct condition frames_used;
+
+/* If true, print each process's memory use when it exits.
+ * Controlled by kernel command-line option "-vmstats". */
+bool vm_stats_on_exit;
+
+/* Frames holding read-only pages of executables, keyed by file and
+ * offset, so that processes running the same program share them.
+ * Guarded by frame_lock. */
+static struct hash text_cache;
+
+static uint64_t text_hash (const struct hash_elem *e, void *aux);
+static bool text_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux);
+
+/* A page of zeros that every never-written anonymous page maps
+ * read-only. It lives outside the frame table and is never evicted
+ * or freed. */
+static struct frame zero_frame;
 
 /* Initializes the virtual memory subsystem by invoking each subsystem's
  * intialize codes. */
@@ -22,7 +78,189 @@ vm_init (void) {
 	register_inspect_intr ();
 	/* DO NOT MODIFY UPPER LINES. */
 	/* TODO: Your code goes here. */
-	list_init(&frame_list);
+	void *base;
+	frame_cnt = palloc_user_pool (&base);
+	frame_base = base;
+	frame_table = calloc (frame_cnt, sizeof *frame_table);
+	if (frame_table == NULL)
+		PANIC ("frame table allocation failed");
+	for (size_t i = 0; i < frame_cnt; i++) {
+		frame_table[i].kva = frame_base + i * PGSIZE;
+		list_init (&frame_table[i].pages);
+	}
+	clock_hand = 0;
+	lock_init (&frame_lock);
+	cond_init (&writeback_done);
+	cond_init (&frames_used);
+	hash_init (&text_cache, text_hash, text_less, NULL);
+
+	zero_frame.kva = palloc_get_page (PAL_ASSERT | PAL_ZERO);
+	list_init (&zero_frame.pages);
+	zero_frame.pinned = true;
+
+	thread_create ("wsscand", PRI_DEFAULT + 1, vm_wsscand, NULL);
+}
+
+/* Returns the frame table entry of user pool page KVA. */
+static struct frame *
+frame_of (void *kva) {
+	size_t idx = ((uint8_t *) kva - frame_base) / PGSIZE;
+
+	ASSERT (idx < frame_cnt);
+	return &frame_table[idx];
+}
+
+/* Adds PAGE to the pages mapping FRAME, and FRAME to the resident
+ * set of PAGE's process. The zero frame is not counted. */
+static void
+frame_link (struct frame *frame, struct page *page) {
+	list_push_back (&frame->pages, &page->frame_elem);
+	frame->ref_cnt++;
+	page->frame = frame;
+	if (frame != &zero_frame) {
+		struct vm_stats *stats = &page->owner->spt.stats;
+		if (frame->ref_cnt == 1 && frames_in_use++ == 0)
+			cond_signal (&frames_used, &frame_lock);
+		stats->rss++;
+		if (frame->age != 0)
+			stats->wss++;
+	}
+}
+
+/* Removes PAGE from the pages mapping FRAME, undoing frame_link().
+ * PAGE's frame pointer is left to the caller. */
+static void
+frame_unlink (struct frame *frame, struct page *page) {
+	list_remove (&page->frame_elem);
+	frame->ref_cnt--;
+	if (frame != &zero_frame) {
+		struct vm_stats *stats = &page->owner->spt.stats;
+		if (frame->ref_cnt == 0)
+			frames_in_use--;
+		stats->rss--;
+		if (frame->age != 0)
+			stats->wss--;
+	}
+}
+
+/* Sets the age of FRAME to AGE, moving it into or out of the working
+ * sets of the processes mapping it. */
+static void
+frame_set_age (struct frame *frame, uint8_t age) {
+	struct list_elem *e;
+
+	if ((frame->age != 0) != (age != 0))
+		for (e = list_begin (&frame->pages); e != list_end (&frame->pages);
+				e = list_next (e)) {
+			struct page *page = list_entry (e, struct page, frame_elem);
+			if (age != 0)
+				page->owner->spt.stats.wss++;
+			else
+				page->owner->spt.stats.wss--;
+		}
+	frame->age = age;
+}
+
+/* Returns true if FRAME must be copied before a page mapping it is
+ * written. */
+static bool
+frame_is_shared (struct frame *frame) {
+	return frame->ref_cnt > 1 || frame == &zero_frame;
+}
+
+/* Returns the text cache hash of the frame holding E. */
+static uint64_t
+text_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct frame *f = hash_entry (e, struct frame, text_elem);
+	return hash_bytes (&f->text_inode, sizeof f->text_inode)
+		^ hash_int (f->text_ofs);
+}
+
+/* Orders the frames holding A and B by file, offset and length. */
+static bool
+text_less (const struct hash_elem *a_, const struct hash_elem *b_,
+		void *aux UNUSED) {
+	const struct frame *a = hash_entry (a_, struct frame, text_elem);
+	const struct frame *b = hash_entry (b_, struct frame, text_elem);
+
+	if (a->text_inode != b->text_inode)
+		return a->text_inode < b->text_inode;
+	if (a->text_ofs != b->text_ofs)
+		return a->text_ofs < b->text_ofs;
+	return a->text_len < b->text_len;
+}
+
+/* Returns true if PAGE is a read-only page of an executable that is
+ * still to be loaded. */
+static bool
+page_is_text (struct page *page) {
+	return page->operations->type == VM_UNINIT
+		&& VM_TYPE (page->uninit.type) == VM_ANON
+		&& (page->uninit.type & VM_FILE_REGION) != 0
+		&& !page->writable;
+}
+
+/* Notes how text PAGE is loaded, before it turns anonymous. */
+static void
+page_note_text (struct page *page) {
+	page->file_inf = page->uninit.aux;
+	page->file_init = page->uninit.init;
+}
+
+/* Turns text PAGE, whose frame has been dropped, back into a page
+ * lazily loaded from its executable. */
+static void
+page_reset_text (struct page *page) {
+	struct file_information *inf = page->file_inf;
+	vm_initializer *init = page->file_init;
+	struct thread *owner = page->owner;
+	bool writable = page->writable;
+
+	uninit_new (page, page->va, init, VM_ANON | VM_FILE_REGION, inf,
+			anon_initializer);
+	page->file_inf = inf;
+	page->file_init = init;
+	page->owner = owner;
+	page->writable = writable;
+}
+
+/* Removes FRAME from the text cache if it is there, dropping the
+ * cache's reference to its inode. */
+static void
+frame_uncache_text (struct frame *frame) {
+	if (frame->text_inode != NULL) {
+		hash_delete (&text_cache, &frame->text_elem);
+		inode_close (frame->text_inode);
+		frame->text_inode = NULL;
+	}
+}
+
+/* Returns FRAME, which no page maps, to the user pool. */
+static void
+frame_release (struct frame *frame) {
+	ASSERT (frame->ref_cnt == 0 && frame != &zero_frame);
+	frame_uncache_text (frame);
+	frame->pinned = false;
+	palloc_free_page (frame->kva);
+}
+
+/* Clears the accessed bit of FRAME in every address space that maps
+ * it. Returns true if any of them had it set. */
+static bool
+frame_clear_accessed (struct frame *frame) {
+	bool accessed = false;
+	struct list_elem *e;
+
+	for (e = list_begin (&frame->pages); e != list_end (&frame->pages);
+			e = list_next (e)) {
+		struct page *page = list_entry (e, struct page, frame_elem);
+		uint64_t *pml4 = page->owner->pml4;
+		if (pml4_is_accessed (pml4, page->va)) {
+			pml4_set_accessed (pml4, page->va, 0);
+			accessed = true;
+		}
+	}
+	return accessed;
 }
 
 /* Get the type of the page. This function is useful if you want to know the
@@ -45,8 +283,7 @@ static bool vm_do_claim_page (struct page *page);
 static struct frame *vm_evict_frame (void);
 
 /* Project 3*/
-static uint64_t hash_func (const struct hash_elem *e, void *aux);
-static bool less_func (const struct hash_elem *a, const struct hash_elem *b, void *aux);
+static void spt_destroy_node (void **node, int level);
 
 /* Create the pending page object with initializer. If you want to create a
  * page, do not create it directly and make it through this function or
@@ -63,6 +300,8 @@ vm_alloc_page_with_initializer (enum vm_type type, void *upage, bool writable,
 		 * TODO: and then create "uninit" page struct by calling uninit_new. You
 		 * TODO: should modify the field after calling the uninit_new. */
 		struct page *page = (struct page *)malloc(sizeof(struct page));
+		if(page == NULL)
+			goto err;
 		if(VM_TYPE(type) == VM_ANON){
 			uninit_new(page, upage, init, type, aux, anon_initializer);
 		}
@@ -70,31 +309,78 @@ vm_alloc_page_with_initializer (enum vm_type type, void *upage, bool writable,
 			uninit_new(page, upage, init, type, aux, file_backed_initializer);
 		}
 		page->writable = writable;
+		page->owner = thread_current ();
 		/* TODO: Insert the page into the spt. */
-		return spt_insert_page(spt, page);
+		if(spt_insert_page(spt, page))
+			return true;
+		free(page);
 	}
 err:
 	return false;
 }
 
+/* Levels of the spt radix tree, and entries in each node. */
+#define SPT_LEVELS 4
+#define SPT_FANOUT (PGSIZE / sizeof (void *))
+
+/* Shift of the address field that indexes each level. */
+static const unsigned spt_shift[SPT_LEVELS] = {
+	PML4SHIFT, PDPESHIFT, PDXSHIFT, PTXSHIFT,
+};
+
+/* Returns the leaf slot of SPT for VA. If a node on the way is
+ * missing, it is created if CREATE is true; otherwise, or if memory
+ * allocation fails, returns a null pointer. */
+static void **
+spt_walk (struct supplemental_page_table *spt, const void *va, bool create) {
+	void **slot = &spt->root;
+
+	for (int level = 0; level < SPT_LEVELS; level++) {
+		if (*slot == NULL
+				&& (!create || (*slot = palloc_get_page (PAL_ZERO)) == NULL))
+			return NULL;
+		slot = (void **) *slot + (((uint64_t) va >> spt_shift[level]) & 0x1ff);
+	}
+	return slot;
+}
+
+/* Returns the page with the lowest address at or above VA among the
+ * leaves under NODE, a node of LEVEL covering addresses from BASE. */
+static struct page *
+spt_next_node (void **node, int level, uint64_t base, uint64_t va) {
+	size_t i = va > base ? (va - base) >> spt_shift[level] : 0;
+
+	for (; i < SPT_FANOUT; i++) {
+		if (node[i] == NULL)
+			continue;
+		if (level == SPT_LEVELS - 1)
+			return node[i];
+		struct page *page = spt_next_node (node[i], level + 1,
+				base + ((uint64_t) i << spt_shift[level]), va);
+		if (page != NULL)
+			return page;
+	}
+	return NULL;
+}
+
 /* Find VA from spt and return page. On error, return NULL. */
 struct page *
 spt_find_page (struct supplemental_page_table *spt, void *va) {
 	// struct page *page = NULL;
 	/* TODO: Fill this function. */
-	struct page *page = (struct page *)malloc(sizeof(struct page));
-	struct hash_elem *e;
+	void **slot = spt_walk (spt, va, false);
 
-	page->va = pg_round_down(va);
-	e = hash_find(spt->spt_hash, &page->elem);
-	free(page);
+	return slot != NULL ? *slot : NULL;
+}
 
-	if(e == NULL){
+/* Returns the page of SPT with the lowest address at or above VA, or
+ * a null pointer if there is none. Pages of a range are visited in
+ * order by passing the address past each page found. */
+struct page *
+spt_next_page (struct supplemental_page_table *spt, void *va) {
+	if (spt->root == NULL)
 		return NULL;
-	}
-	else{
-		return hash_entry(e, struct page, elem);
-	}
+	return spt_next_node (spt->root, 0, 0, (uint64_t) pg_round_down (va));
 }
 
 /* Insert PAGE into spt with validation. */
@@ -102,20 +388,21 @@ bool
 spt_insert_page (struct supplemental_page_table *spt, struct page *page) {
 	// int succ = false;
 	/* TODO: Fill this function. */
-	struct hash_elem *succ = hash_insert(spt->spt_hash, &page->elem);
-	
-	if(succ == NULL){
-		return true;
-	}
-	else{
+	void **slot = spt_walk (spt, page->va, true);
+
+	if (slot == NULL || *slot != NULL)
 		return false;
-	}
+	*slot = page;
+	return true;
 }
 
 void
 spt_remove_page (struct supplemental_page_table *spt, struct page *page) {
+	void **slot = spt_walk (spt, page->va, false);
+
+	ASSERT (slot != NULL && *slot == page);
+	*slot = NULL;
 	vm_dealloc_page (page);
-	return true;
 }
 
 /* Get the struct frame, that will be evicted. */
@@ -123,31 +410,99 @@ static struct frame *
 vm_get_victim (void) {
 	//struct frame *victim = NULL;
 	 /* TODO: The policy for eviction is up to you. */
-	struct thread *curr = thread_current();
-	struct list_elem *e;
-	struct frame *victim;
-	if(!list_empty(&frame_list)){
-		for(e = list_begin(&frame_list); e != list_end(&frame_list); e = list_next(e)){
-			victim = list_entry(e, struct thread, elem);
-			if(pml4_is_accessed(curr->pml4, victim->page->va)){
-				pml4_set_accessed(curr->pml4, victim->page->va, 0);
-			}
-			else{
-				return victim;
-			}
-		}
+	/* Clock: sweep from where the last search stopped, giving each
+	 * recently accessed frame a second chance. The first turn takes
+	 * only frames that have aged out of the working set, so that the
+	 * processes holding more than their working set give up frames
+	 * first. Two more turns find a victim unless every frame is
+	 * pinned. */
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+	for(size_t i = 0; i < 3 * frame_cnt; i++){
+		struct frame *victim = &frame_table[clock_hand];
+		clock_hand = (clock_hand + 1) % frame_cnt;
+
+		if(victim->ref_cnt == 0 || victim->pinned || victim->writeback)
+			continue;
+		if(frame_clear_accessed(victim))
+			frame_set_age(victim, victim->age | AGE_REFERENCED);
+		else if(victim->age == 0 || i >= frame_cnt)
+			return victim;
 	}
 	return NULL;
 }
 
+/* Splits the 2 MB mapping that holds PAGE's frame, if any, into 4 kB
+ * mappings, so that the frame can be unmapped or remapped on its
+ * own. */
+static void
+vm_split_huge (struct page *page) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	struct frame *frame = page->frame;
+	if (frame == NULL || !frame->huge)
+		return;
+
+	struct frame *head = frame_of ((void *) ((uint64_t) frame->kva
+				& ~(HUGE_PGSIZE - 1)));
+	void *va = (void *) ((uint64_t) page->va & ~(HUGE_PGSIZE - 1));
+	if (page->owner->pml4 != NULL)
+		pml4_split_huge_page (page->owner->pml4, va, head->split_pt);
+	else
+		palloc_free_page (head->split_pt);
+	head->split_pt = NULL;
+	for (size_t i = 0; i < HUGE_PGCNT; i++)
+		head[i].huge = false;
+}
+
+/* Drops FRAME if it is a shared text frame, without writing it
+ * anywhere: each page mapping it goes back to being lazily loaded
+ * from its executable, from where it can be shared again through the
+ * text cache. Returns false, leaving FRAME alone, otherwise. */
+static bool
+frame_drop_text (struct frame *frame) {
+	struct list_elem *e;
+
+	if (frame->text_inode == NULL)
+		return false;
+	for (e = list_begin (&frame->pages); e != list_end (&frame->pages);
+			e = list_next (e))
+		if (list_entry (e, struct page, frame_elem)->file_inf == NULL)
+			return false;
+
+	while (!list_empty (&frame->pages)) {
+		struct page *page = list_entry (list_front (&frame->pages),
+				struct page, frame_elem);
+		pml4_clear_page (page->owner->pml4, page->va);
+		frame_unlink (frame, page);
+		page_reset_text (page);
+	}
+	return true;
+}
+
 /* Evict one page and return the corresponding frame.
  * Return NULL on error.*/
+/* A victim that cannot be swapped out stays resident, and another
+ * one is tried. */
 static struct frame *
 vm_evict_frame (void) {
-	struct frame *victim = vm_get_victim ();
-	/* TODO: swap out the victim and return the evicted frame. */
-	swap_out(victim->page);
-	return victim;
+	for(size_t tries = 0; tries < frame_cnt; tries++){
+		struct frame *victim = vm_get_victim ();
+		/* TODO: swap out the victim and return the evicted frame. */
+		if(victim == NULL)
+			return NULL;
+		/* Swapping out any one page evicts the frame for all sharers. */
+		struct page *page = list_entry(list_front(&victim->pages), struct page,
+				frame_elem);
+		vm_split_huge(page);
+		if(!frame_drop_text(victim) && !swap_out(page))
+			continue;
+		frame_uncache_text(victim);
+		while(!list_empty(&victim->pages))
+			frame_unlink(victim, list_entry(list_front(&victim->pages),
+						struct page, frame_elem));
+		return victim;
+	}
+	return NULL;
 }
 
 /* palloc() and get frame. If there is no available page, evict the page
@@ -158,61 +513,361 @@ static struct frame *
 vm_get_frame (void) {
 	//struct frame *frame = NULL;
 	/* TODO: Fill this function. */
-	struct frame *frame = (struct frame *)malloc(sizeof(struct frame));
-	frame->kva = palloc_get_page(PAL_USER);
-	if(frame->kva == NULL){
+	struct frame *frame;
+
+	lock_acquire(&frame_lock);
+	void *kva = palloc_get_page(PAL_USER);
+	if(kva != NULL)
+		frame = frame_of(kva);
+	else{
 		frame = vm_evict_frame();
-		frame->page = NULL;
-		return frame;
+		if(frame == NULL)
+			PANIC("out of frames and swap slots");
 	}
-	frame->page = NULL;
-	list_push_back(&frame_list, &frame->frame_elem);
+	frame->pinned = true;
+	frame->age = AGE_REFERENCED;
+	lock_release(&frame_lock);
 	return frame;
 }
 
+/* Allocates HUGE_PGCNT frames of one 2 MB aligned run, without
+ * evicting, and returns the first, or a null pointer. The frames are
+ * pinned. */
+static struct frame *
+vm_get_huge_frames (void) {
+	struct frame *head = NULL;
+	void *pt = palloc_get_page (0);
+
+	if (pt == NULL)
+		return NULL;
+	lock_acquire (&frame_lock);
+	void *kva = palloc_get_multiple_aligned (PAL_USER, HUGE_PGCNT, HUGE_PGCNT);
+	if (kva != NULL) {
+		head = frame_of (kva);
+		for (size_t i = 0; i < HUGE_PGCNT; i++) {
+			head[i].pinned = true;
+			head[i].huge = true;
+			head[i].age = AGE_REFERENCED;
+		}
+		head->split_pt = pt;
+	}
+	lock_release (&frame_lock);
+	if (head == NULL)
+		palloc_free_page (pt);
+	return head;
+}
+
 /* Growing the stack. */
 static void
 vm_stack_growth (void *addr) {
-	if(vm_alloc_page_with_initializer(VM_ANON, addr, true, NULL, NULL)){
-		vm_claim_page(addr);
+	/* The page is claimed when the access is retried. */
+	if(vm_alloc_page_with_initializer(VM_ANON, addr, true, NULL, NULL))
 		thread_current()->stack_bottom -= PGSIZE;
+}
+
+/* Returns true if PAGE is an anonymous page that was never touched
+ * and has no initializer, so that its contents are all zeros. */
+static bool
+page_is_zero_fill (struct page *page) {
+	return page->operations->type == VM_UNINIT
+		&& VM_TYPE(page->uninit.type) == VM_ANON
+		&& page->uninit.init == NULL;
+}
+
+/* Backs the 2 MB aligned region holding PAGE with one large page, if
+ * every page of the region is hinted VM_HUGE, untouched, and of the
+ * same writability. Returns false if the region does not qualify or
+ * no aligned run of frames is free, for the caller to fall back to
+ * 4 kB pages. Otherwise returns true and sets *SUCCESS to whether
+ * the region was loaded; if a page fails to load, the pages loaded
+ * before it are mapped as 4 kB pages and the rest of the frames are
+ * freed. */
+static bool
+vm_claim_huge (struct page *page, bool *success) {
+	struct supplemental_page_table *spt = &page->owner->spt;
+	uint8_t *base = (uint8_t *) ((uint64_t) page->va & ~(HUGE_PGSIZE - 1));
+
+	for (size_t i = 0; i < HUGE_PGCNT; i++) {
+		struct page *p = spt_find_page (spt, base + i * PGSIZE);
+		if (p == NULL || p->operations->type != VM_UNINIT
+				|| (p->uninit.type & VM_HUGE) == 0
+				|| p->writable != page->writable)
+			return false;
+	}
+
+	struct frame *head = vm_get_huge_frames ();
+	if (head == NULL)
+		return false;
+	lock_acquire (&frame_lock);
+	for (size_t i = 0; i < HUGE_PGCNT; i++)
+		frame_link (&head[i], spt_find_page (spt, base + i * PGSIZE));
+	lock_release (&frame_lock);
+	size_t loaded = 0;
+	while (loaded < HUGE_PGCNT) {
+		struct page *p = spt_find_page (spt, base + loaded * PGSIZE);
+		bool zero_fill = page_is_zero_fill (p);
+		if (!swap_in (p, head[loaded].kva))
+			break;
+		if (zero_fill)
+			memset (head[loaded].kva, 0, PGSIZE);
+		loaded++;
+	}
+
+	lock_acquire (&frame_lock);
+	*success = loaded == HUGE_PGCNT;
+	if (!*success || !pml4_set_huge_page (page->owner->pml4, base, head->kva,
+				page->writable)) {
+		/* Map the loaded frames one by one instead. The page that
+		 * failed to load keeps its frame, as in vm_do_claim_page(). */
+		palloc_free_page (head->split_pt);
+		head->split_pt = NULL;
+		for (size_t i = 0; i < HUGE_PGCNT; i++) {
+			struct page *p = spt_find_page (spt, base + i * PGSIZE);
+			head[i].huge = false;
+			head[i].pinned = false;
+			if (i < loaded) {
+				if (!pml4_set_page (p->owner->pml4, p->va, head[i].kva,
+							p->writable))
+					*success = false;
+			} else if (i > loaded) {
+				frame_unlink (&head[i], p);
+				p->frame = NULL;
+				frame_release (&head[i]);
+			}
+		}
+	} else {
+		for (size_t i = 0; i < HUGE_PGCNT; i++)
+			head[i].pinned = false;
+	}
+	lock_release (&frame_lock);
+	return true;
+}
+
+/* Returns true if PAGE is still to be loaded from a file region. */
+static bool
+page_is_file_region (struct page *page) {
+	return page->operations->type == VM_UNINIT
+		&& (page->uninit.type & VM_FILE_REGION) != 0;
+}
+
+/* Maps PAGE, a read-only page of an executable still to be loaded,
+ * to the frame holding the same part of the same file for another
+ * process, if there is one. The following pages of the executable
+ * that are in the text cache are mapped too, up to FAULT_AROUND_MAX
+ * pages. Returns false if PAGE is not cached. */
+static bool
+vm_share_text (struct page *page) {
+	struct supplemental_page_table *spt = &page->owner->spt;
+	size_t cnt = 0;
+
+	lock_acquire (&frame_lock);
+	while (cnt < FAULT_AROUND_MAX) {
+		struct page *p = spt_find_page (spt, page->va + cnt * PGSIZE);
+		if (p == NULL || !page_is_text (p))
+			break;
+
+		struct file_information *inf = p->uninit.aux;
+		struct frame key;
+		key.text_inode = file_get_inode (inf->file);
+		key.text_ofs = inf->ofs;
+		key.text_len = inf->read_bytes;
+		struct hash_elem *e = hash_find (&text_cache, &key.text_elem);
+		if (e == NULL)
+			break;
+
+		struct frame *frame = hash_entry (e, struct frame, text_elem);
+		if (!pml4_set_page (p->owner->pml4, p->va, frame->kva, false))
+			break;
+		page_note_text (p);
+		anon_initializer (p, VM_ANON, frame->kva);
+		frame_link (frame, p);
+		cnt++;
+	}
+	lock_release (&frame_lock);
+	return cnt > 0;
+}
+
+/* Claims PAGE, which is lazily loaded from a file, together with the
+ * unloaded pages that follow it in the same file region, filling all
+ * of them from a single read. The window doubles while faults are
+ * sequential, up to FAULT_AROUND_MAX pages. */
+static bool
+vm_claim_around (struct page *page) {
+	struct supplemental_page_table *spt = &page->owner->spt;
+	struct fault_around *fa = &spt->around;
+	struct file_information *inf = page->uninit.aux;
+	struct inode *inode = file_get_inode (inf->file);
+	struct page *pages[FAULT_AROUND_MAX];
+	off_t bytes = inf->read_bytes;
+	size_t cnt = 1;
+
+	if (page->va == fa->next && fa->window * 2 <= FAULT_AROUND_MAX)
+		fa->window *= 2;
+	else if (page->va != fa->next)
+		fa->window = FAULT_AROUND_MIN;
+
+	/* Extend over following pages whose data continues the file
+	 * region without a gap. */
+	pages[0] = page;
+	while (cnt < fa->window && bytes == (off_t) cnt * PGSIZE) {
+		struct page *next = spt_find_page (spt, page->va + cnt * PGSIZE);
+		if (next == NULL || !page_is_file_region (next)
+				|| next->uninit.init != page->uninit.init)
+			break;
+		struct file_information *next_inf = next->uninit.aux;
+		if (file_get_inode (next_inf->file) != inode
+				|| next_inf->ofs != inf->ofs + bytes)
+			break;
+		pages[cnt++] = next;
+		bytes += next_inf->read_bytes;
 	}
+	fa->next = page->va + cnt * PGSIZE;
+
+	if (cnt > 1)
+		fa->buf = palloc_get_multiple (0, cnt);
+	if (fa->buf != NULL) {
+		fa->inode = inode;
+		fa->ofs = inf->ofs;
+		fa->len = file_read_at (inf->file, fa->buf, bytes, inf->ofs);
+	}
+
+	bool success = vm_do_claim_page (page);
+	if (fa->buf != NULL) {
+		/* Neighbors are populated only from data actually read. */
+		for (size_t i = 1; success && i < cnt; i++) {
+			struct file_information *next_inf = pages[i]->uninit.aux;
+			if (next_inf->ofs + (off_t) next_inf->read_bytes > fa->ofs + fa->len)
+				break;
+			vm_do_claim_page (pages[i]);
+		}
+		palloc_free_multiple (fa->buf, cnt);
+		fa->buf = NULL;
+	}
+	return success;
+}
+
+/* Reads SIZE bytes of FILE starting at OFS into BUFFER, like
+ * file_read_at(). Lazy loaders use it so that the bytes come from the
+ * fault-around read when they are part of it. */
+off_t
+vm_file_read (struct file *file, void *buffer, off_t size, off_t ofs) {
+	struct fault_around *fa = &thread_current ()->spt.around;
+
+	if (fa->buf != NULL && file_get_inode (file) == fa->inode
+			&& ofs >= fa->ofs && ofs + size <= fa->ofs + fa->len) {
+		memcpy (buffer, fa->buf + (ofs - fa->ofs), size);
+		return size;
+	}
+	return file_read_at (file, buffer, size, ofs);
+}
+
+/* Maps never-written anonymous PAGE to the shared zero frame. The
+ * first write gives it a private frame through vm_handle_wp. */
+static bool
+vm_map_zero (struct page *page) {
+	anon_initializer (page, VM_ANON, NULL);
+	lock_acquire (&frame_lock);
+	frame_link (&zero_frame, page);
+	bool success = pml4_set_page (page->owner->pml4, page->va,
+			zero_frame.kva, false);
+	lock_release (&frame_lock);
+	return success;
 }
 
 /* Handle the fault on write_protected page */
+/* PAGE is writable but mapped read-only because it shares its frame
+ * copy-on-write. Gives PAGE a private copy, or takes the frame over
+ * if the other sharers are gone, and maps it writable. */
 static bool
-vm_handle_wp (struct page *page UNUSED) {
-	void *kva = page->frame->kva;
-	page->frame->kva = palloc_get_page(PAL_USER);
-	memcpy(page->frame->kva, kva, PGSIZE);
-	pml4_set_page(thread_current()->pml4, page->va, page->frame->kva, page->writable);
+vm_handle_wp (struct page *page) {
+	struct frame *copy = NULL;
+	bool success = true;
 
-	return true;
+	lock_acquire(&frame_lock);
+	vm_split_huge(page);
+	if(page->frame != NULL && frame_is_shared(page->frame)){
+		/* Allocating may evict, so the frame is rechecked below. */
+		lock_release(&frame_lock);
+		copy = vm_get_frame();
+		lock_acquire(&frame_lock);
+	}
+
+	struct frame *frame = page->frame;
+	if(frame != NULL && frame_is_shared(frame) && copy != NULL){
+		memcpy(copy->kva, frame->kva, PGSIZE);
+		frame_unlink(frame, page);
+		frame_link(copy, page);
+		frame = copy;
+	}
+	if(copy != NULL && copy->ref_cnt == 0)
+		frame_release(copy);
+	else if(copy != NULL)
+		copy->pinned = false;
+
+	/* An evicted page is faulted back in, privately, on retry. */
+	if(frame != NULL){
+		pml4_clear_page(page->owner->pml4, page->va);
+		success = pml4_set_page(page->owner->pml4, page->va, frame->kva, true);
+	}
+	lock_release(&frame_lock);
+	return success;
+}
+
+/* Counts a page fault against SPT, closing the current fault-rate
+ * period if it has ended. A process that took no faults for a whole
+ * period has a rate of 0. */
+static void
+vm_count_fault (struct supplemental_page_table *spt) {
+	int64_t elapsed = timer_elapsed (spt->fault_period);
+
+	if (elapsed >= WS_SCAN_TICKS) {
+		spt->stats.fault_rate = elapsed < 2 * WS_SCAN_TICKS ? spt->faults : 0;
+		spt->faults = 0;
+		spt->fault_period = timer_ticks () - elapsed % WS_SCAN_TICKS;
+	}
+	spt->faults++;
 }
 
-/* Return true on success */
+/* Return true on success. On failure the caller kills the process,
+ * or resumes a kernel access to user memory at its fixup. */
 bool
 vm_try_handle_fault (struct intr_frame *f, void *addr, bool user UNUSED, bool write UNUSED, bool not_present) {
 	// struct page *page = NULL;
 	/* TODO: Validate the fault */
 	/* TODO: Your code goes here */
 	struct thread *curr = thread_current();
-	struct page *page = spt_find_page(&curr->spt, addr);
 	if(is_kernel_vaddr(addr))
-	{
-		exit(-1);
-		kill(f);
+		return false;
+	vm_count_fault(&curr->spt);
+	struct page *page = spt_find_page(&curr->spt, addr);
+	if(page == NULL){
+		/* First touch of an mmap region: add a window of its pages,
+		 * for fault-around to fill. */
+		struct vma *vma = vma_find(&curr->spt, addr);
+		if(vma != NULL && vma_materialize(vma, addr, FAULT_AROUND_MAX))
+			page = spt_find_page(&curr->spt, addr);
 	}
-	if(!not_present && write && page->writable && page){
+	if(!not_present && write && page && page->writable){
 		return vm_handle_wp(page);
 	}
-	else if(!not_present && write && !(page->writable && page)){
-		exit(-1);
-		kill(f);
+	else if(!not_present && write && !(page && page->writable)){
+		return false;
 	}
 
-	if(vm_claim_page(addr)){ // lazy load
-		return true;
+	if(page != NULL){ // lazy load
+		bool success;
+		if(!vm_claim_huge(page, &success)){
+			if(page_is_text(page) && vm_share_text(page))
+				success = true;
+			/* A read of an untouched anonymous page needs no frame. */
+			else if(!write && page_is_zero_fill(page))
+				success = vm_map_zero(page);
+			else if(page_is_file_region(page))
+				success = vm_claim_around(page);
+			else
+				success = vm_do_claim_page(page);
+		}
+		return success;
 	}
 	else{
 		void *rsp_stack = is_kernel_vaddr(f->rsp) ? curr->rsp_stack : f->rsp;
@@ -221,12 +876,9 @@ vm_try_handle_fault (struct intr_frame *f, void *addr, bool user UNUSED, bool wr
 			return true;
 		}
 		else{ // true page fault
-			//return false;
-			exit(-1);
-			kill(f);
+			return false;
 		}
 	}
-
 }
 
 /* Free the page.
@@ -237,6 +889,47 @@ vm_dealloc_page (struct page *page) {
 	free (page);
 }
 
+/* Ages every frame in use, once each WS_SCAN_TICKS, so that the
+ * working set of each process tracks the pages it referenced over the
+ * last 8 scans. Sleeps without waking up while no frame is in use. */
+static void
+vm_wsscand (void *aux UNUSED) {
+	for (;;) {
+		lock_acquire (&frame_lock);
+		while (frames_in_use == 0)
+			cond_wait (&frames_used, &frame_lock);
+		lock_release (&frame_lock);
+
+		timer_sleep (WS_SCAN_TICKS);
+
+		lock_acquire (&frame_lock);
+		for (size_t i = 0; i < frame_cnt; i++) {
+			struct frame *frame = &frame_table[i];
+
+			if (frame->ref_cnt != 0 && !frame->pinned) {
+				uint8_t age = frame->age >> 1;
+				if (frame_clear_accessed (frame))
+					age |= AGE_REFERENCED;
+				frame_set_age (frame, age);
+			}
+			if (i % FRAME_LOCK_BATCH == FRAME_LOCK_BATCH - 1) {
+				lock_release (&frame_lock);
+				lock_acquire (&frame_lock);
+			}
+		}
+		lock_release (&frame_lock);
+	}
+}
+
+/* Stores the memory use of T, which must be a user process, in
+ * STATS. */
+void
+vm_get_stats (struct thread *t, struct vm_stats *stats) {
+	lock_acquire (&frame_lock);
+	*stats = t->spt.stats;
+	lock_release (&frame_lock);
+}
+
 /* Claim the page that allocate on VA. */
 bool
 vm_claim_page (void *va) {
@@ -253,61 +946,203 @@ vm_claim_page (void *va) {
 	}
 }
 
+/* Releases the frame lock while the caller writes out frames it has
+ * marked WRITEBACK. Meanwhile those frames are not evicted, and
+ * threads that would remap or free them wait in frame_wait(). */
+void
+vm_writeback_begin (void) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+	lock_release(&frame_lock);
+}
+
+/* Takes the frame lock back after vm_writeback_begin() and wakes the
+ * threads in frame_wait(). The caller clears WRITEBACK on its frames
+ * before it releases the lock again. */
+void
+vm_writeback_end (void) {
+	lock_acquire(&frame_lock);
+	cond_broadcast(&writeback_done, &frame_lock);
+}
+
+/* Waits until the frame holding PAGE, if any, is not being written
+ * back. The frame lock must be held; it is released while waiting. */
+static void
+frame_wait (struct page *page) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+	while(page->frame != NULL && page->frame->writeback)
+		cond_wait(&writeback_done, &frame_lock);
+}
+
+/* Releases the frame holding PAGE, if any, unmapping it from its
+ * owner's address space and writing a file page back. The frame lock
+ * must be held. */
+static void
+frame_detach (struct page *page) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	frame_wait(page);
+	vm_split_huge(page);
+	struct frame *frame = page->frame;
+	if(frame != NULL){
+		if(VM_TYPE(page->operations->type) == VM_FILE)
+			file_backed_writeback(page);
+		if(page->owner->pml4 != NULL)
+			pml4_clear_page(page->owner->pml4, page->va);
+		frame_unlink(frame, page);
+		page->frame = NULL;
+		if(frame->ref_cnt == 0 && frame != &zero_frame)
+			frame_release(frame);
+	}
+}
+
+/* Releases the frame holding PAGE, if any, unmapping it from its
+ * owner's address space. */
+void
+vm_free_frame (struct page *page) {
+	/* Taking the lock, and frame_detach(), wait out an eviction of PAGE
+	 * in progress. */
+	lock_acquire(&frame_lock);
+	frame_detach(page);
+	lock_release(&frame_lock);
+}
+
 /* Claim the PAGE and set up the mmu. */
 static bool
 vm_do_claim_page (struct page *page) {
+	bool zero_fill = page_is_zero_fill (page);
 	struct frame *frame = vm_get_frame ();
 	/* Set links */
-	frame->page = page;
-	page->frame = frame;
+	lock_acquire (&frame_lock);
+	/* PAGE may be on its way out to its file. If the writeback failed,
+	 * it is resident and mapped again, and the new frame is unused. */
+	frame_wait (page);
+	if (page->frame != NULL) {
+		frame_release (frame);
+		lock_release (&frame_lock);
+		return true;
+	}
+	frame_link (frame, page);
+	lock_release (&frame_lock);
+
+	/* Note the file data before swap_in() turns PAGE anonymous. */
+	struct inode *text_inode = NULL;
+	if (page_is_text (page)) {
+		struct file_information *inf = page->uninit.aux;
+		text_inode = file_get_inode (inf->file);
+		frame->text_ofs = inf->ofs;
+		frame->text_len = inf->read_bytes;
+		page_note_text (page);
+	}
 
 	/* TODO: Insert page table entry to map page's VA to frame's PA. */
-	struct thread *curr = thread_current();
+	bool success = pml4_set_page (page->owner->pml4, page->va, frame->kva,
+			page->writable) && swap_in(page, frame->kva);
+	/* Frames are reused without clearing. */
+	if (zero_fill)
+		memset (frame->kva, 0, PGSIZE);
 
-	if(!pml4_set_page (curr->pml4, page->va, frame->kva, page->writable)){
-		return false;
-	}
-	else{
-		return swap_in(page, frame->kva);
+	lock_acquire (&frame_lock);
+	if (success && text_inode != NULL) {
+		/* Another process may have cached the same page meanwhile.
+		 * The cache holds the inode open, so that its address is not
+		 * reused for another file while the entry exists. */
+		frame->text_inode = text_inode;
+		if (hash_insert (&text_cache, &frame->text_elem) != NULL)
+			frame->text_inode = NULL;
+		else
+			inode_reopen (text_inode);
 	}
+	frame->pinned = false;
+	lock_release (&frame_lock);
+	return success;
 }
 
 /* Initialize new supplemental page table */
 void
 supplemental_page_table_init (struct supplemental_page_table *spt) {
-	struct hash *spt_hash = malloc(sizeof(struct hash));
-	hash_init(spt_hash, hash_func, less_func, NULL);
-	spt->spt_hash = spt_hash;
+	spt->root = NULL;
+	spt->vmas = NULL;
+	spt->vma_cnt = spt->vma_cap = 0;
+	spt->around.next = NULL;
+	spt->around.window = FAULT_AROUND_MIN;
+	spt->around.buf = NULL;
+	spt->stats.rss = spt->stats.wss = 0;
+	spt->stats.fault_rate = 0;
+	spt->faults = 0;
+	spt->fault_period = timer_ticks ();
+}
+
+/* Makes DST, a new page of the child, share anonymous page SRC
+ * copy-on-write. A resident frame is mapped read-only in both address
+ * spaces until one of them writes; a swapped-out page shares its swap
+ * slot instead. */
+static bool
+vm_share_page (struct page *dst, struct page *src) {
+	bool success = true;
+
+	anon_initializer (dst, VM_ANON, NULL);
+	dst->file_inf = src->file_inf;
+	dst->file_init = src->file_init;
+	lock_acquire (&frame_lock);
+	vm_split_huge (src);
+	struct frame *frame = src->frame;
+	if (frame != NULL) {
+		pml4_clear_page (src->owner->pml4, src->va);
+		success = pml4_set_page (src->owner->pml4, src->va, frame->kva, false)
+			&& pml4_set_page (dst->owner->pml4, dst->va, frame->kva, false);
+		frame_link (frame, dst);
+	} else
+		anon_share_slot (dst, src);
+	lock_release (&frame_lock);
+	return success;
 }
 
 /* Copy supplemental page table from src to dst */
 bool
 supplemental_page_table_copy (struct supplemental_page_table *dst, struct supplemental_page_table *src) {
-	struct hash_iterator itr;
-	hash_first(&itr, src->spt_hash);
-	while (hash_next(&itr))
+	struct page *page_src;
+
+	if (!vma_copy (dst, src))
+		return false;
+	for (page_src = spt_next_page (src, NULL); page_src != NULL;
+			page_src = spt_next_page (src, page_src->va + PGSIZE))
 	{
-		struct page *page_src = hash_entry(hash_cur(&itr), struct page, elem);
 		enum vm_type type = page_get_type(page_src);
 		void *upage = page_src->va;
 		bool writable = page_src->writable;
 		vm_initializer *init = page_src->uninit.init;
 		void *aux = page_src->uninit.aux;
 
-		if(page_src->operations->type == VM_UNINIT){
-			if (!vm_alloc_page_with_initializer(type, upage, writable, init, aux))
+		if(page_src->operations->type == VM_UNINIT && type == VM_FILE){
+			/* The child creates it from its own mapping when touched. */
+			continue;
+		}
+		else if(page_src->operations->type == VM_UNINIT){
+			if (!vm_alloc_page_with_initializer(page_src->uninit.type, upage,
+						writable, init, aux))
 				return false;
 		}
-		else{
+		else if(type == VM_ANON){
 			if(!vm_alloc_page(type, upage, writable))
 				return false;
-			if(!vm_claim_page(upage))
+			if(!vm_share_page(spt_find_page(dst, upage), page_src))
 				return false;
 		}
-		if(page_src->operations->type != VM_UNINIT)
-		{
+		else{
+			struct vma *vma = vma_find(dst, upage);
+			if(vma == NULL || !vma_materialize(vma, upage, 1))
+				return false;
+			if(!vm_claim_page(upage))
+				return false;
+			/* Claiming the child's page may have evicted the parent's. */
 			struct page *page_dst = spt_find_page(dst, upage);
-			memcpy(page_dst->frame->kva, page_src->frame->kva, PGSIZE);
+			if(page_src->frame != NULL){
+				memcpy(page_dst->frame->kva, page_src->frame->kva, PGSIZE);
+				/* Unwritten changes must reach the file from the child
+				 * too. */
+				if(pml4_is_dirty(page_src->owner->pml4, page_src->va))
+					pml4_set_dirty(page_dst->owner->pml4, page_dst->va, true);
+			}
 		}
 	}
 	return true;
@@ -318,27 +1153,46 @@ void
 supplemental_page_table_kill (struct supplemental_page_table *spt) {
 	/* TODO: Destroy all the supplemental_page_table hold by thread and
 	 * TODO: writeback all the modified contents to the storage. */
-	struct hash_iterator itr;
-	hash_first(&itr, spt->spt_hash);
-
-	while (hash_next(&itr)){
-		struct page *page = hash_entry(hash_cur(&itr), struct page, elem);
-		if (page->operations->type == VM_FILE)
-			do_munmap(page->va);
-	}
-	hash_destroy(spt->spt_hash, NULL);
+	/* Destroying a file-backed page writes it back, as munmap would. */
+	if(spt->root != NULL)
+		spt_destroy_node(spt->root, 0);
+	spt->root = NULL;
+	vma_destroy_all(spt);
 }
 
 /* Project 3*/
-uint64_t 
-hash_func (const struct hash_elem *e, void *aux UNUSED){
-	struct page *p = hash_entry(e, struct page, elem);
-	return hash_bytes(&p->va, sizeof(p->va));
+/* Releases the frames and swap slots of the pages in LEAF, a last
+ * level node of a dying spt, in one pass that takes each lock once
+ * per batch rather than once per page. Dirty file pages are written
+ * back in clusters along the way. The pages themselves are left to be
+ * destroyed, which then finds nothing left to release. */
+static void
+spt_release_leaf (void **leaf){
+	lock_acquire(&frame_lock);
+	for(size_t i = 0; i < SPT_FANOUT; i++){
+		if(leaf[i] != NULL)
+			frame_detach(leaf[i]);
+		if(i % FRAME_LOCK_BATCH == FRAME_LOCK_BATCH - 1){
+			lock_release(&frame_lock);
+			lock_acquire(&frame_lock);
+		}
+	}
+	lock_release(&frame_lock);
+	anon_release_slots((struct page **) leaf, SPT_FANOUT);
 }
 
-bool 
-less_func (const struct hash_elem *a_, const struct hash_elem *b_, void *aux UNUSED){
-	struct page *a = hash_entry(a_, struct page, elem);
-	struct page *b = hash_entry(b_, struct page, elem);
-	return a->va < b->va;
+/* Frees NODE, a node of LEVEL of an spt, and everything under it. */
+static void
+spt_destroy_node (void **node, int level){
+	if(level == SPT_LEVELS - 1)
+		spt_release_leaf(node);
+	for(size_t i = 0; i < SPT_FANOUT; i++){
+		if(node[i] == NULL)
+			continue;
+		if(level == SPT_LEVELS - 1)
+			vm_dealloc_page(node[i]);
+		else
+			spt_destroy_node(node[i], level + 1);
+	}
+	palloc_free_page(node);
 }